@@ -20,63 +20,173 @@
 #include <stddef.h>
 #include "gfserver.h"
 #include "steque.h"
+#include "ringq.h"
+#include "slab.h"
+#include "shm_channel.h"
+#include "gfrange.h"
 
 #define SHM_NAME "SHM_"
 #define MQ_REQUEST_NAME "/RequestMQ"
-#define MAX_SHMNAME_LEN 32
+#define MAX_SHMNAME_LEN 64
 #define MAX_PATH_LEN 256
 #define MAX_MSG_NUM 10
 #define MAX_MSG_SIZE 1024
+#define MAX_STRIPES 8
+#define MAX_NAMESPACE_LEN 16
+#define MAX_LISTENERS 64
+#define CACHE_LINE 64
 
 
 
-steque_t *proxy_queue;
-steque_t *cache_queue;
 
+typedef struct {
+    char shmName[MAX_SHMNAME_LEN];
+    size_t shmOffset;
+}MSQStripe_t;
+
+// Control messages share the request queue, filePath carries the sender's segment prefix
+typedef enum {
+    MSQ_FILE = 0,
+    MSQ_REGISTER, // A webproxy started sending requests
+    MSQ_UNREGISTER // A webproxy is gone, shmName names its huge page region if it had one
+}MSQKind_t;
 
 typedef struct {
+    MSQKind_t kind;
     char filePath[MAX_PATH_LEN];
     char shmName[MAX_SHMNAME_LEN];
     size_t nSegments;
     size_t segmentSize;
+    size_t shmOffset; // Segment offset inside the shmName mapping
+    size_t regionSize; // Size of the whole shmName mapping
+    int node; // NUMA node the segment lives on
+    size_t offset; // First byte to send
+    size_t length; // Bytes to send from offset, 0 up to the end of the file
+    int stripe; // Stripe a helper worker should fill, 0 for the request itself
+    int nStripes; // Chunk k of the file goes through segment k % nStripes
+    uint64_t ticket; // Tells this request's stripes from those of requests reusing the segments
+    MSQStripe_t stripes[MAX_STRIPES - 1]; // Segments of stripes 1 and up, same size as the first
 }MSQRequest_t;
+_Static_assert(sizeof(MSQRequest_t) <= MAX_MSG_SIZE, "MSQRequest_t must fit in a message");
 
 typedef struct {
     pthread_cond_t cond;
     pthread_mutex_t mutex;
 } lock_t;
-lock_t *proxy_lock, *cache_lock;
 
+typedef struct ContextProxy_t ContextProxy_t;
+
+// An object a shard's cache published, as mapped by the proxy. It is unmapped once the cache
+// retired it and no request reads it anymore
 typedef struct {
-    size_t nSegments;
-    size_t segmentSize;
+    const ShmObject_t *object;
+    size_t size;
+    int refs; // Requests reading it, plus one while it is the shard's current object
+}ShmMapping_t;
+
+typedef struct {
+    int index;
+    char mqName[MAX_SHMNAME_LEN];
     mqd_t mqRequest;
+    ringq_t segQueue[MAX_NUMA_NODES]; // Free ContextProxy_t segments of this shard, per node
+    ringq_t parked; // Segments whose memory was given back, reused first when the pool grows
+    ringq_t quarantine; // Segments of timed out requests, reused once the cache is done with them
+    size_t nWaiting; // Requests waiting for a free segment
+    ContextProxy_t **segments; // Every segment created so far, by index
+    size_t nCreated;
+    size_t nActive; // Created and not parked
+    pthread_mutex_t growLock;
+    size_t stride; // Distance between segments carved from the region
+    char regionName[MAX_SHMNAME_LEN]; // Huge page region the segments are carved from, if any
+    char *region;
+    size_t regionSize;
+    int regionFd;
+    ShmMapping_t *filter; // Negative lookup filter published by the shard's cache, if attached
+    ShmMapping_t *shmIndex; // Index and bodies published by the shard's cache, if attached
+    uint64_t filterRetry; // shm_channel_clock_us() before which we don't look for a filter again
+    uint64_t indexRetry;
+    pthread_mutex_t attachLock;
+}ContextShard_t;
+
+typedef struct {
+    size_t nSegments; // Per shard, at startup
+    size_t minSegments; // Bounds of the elastic pool, per shard
+    size_t maxSegments;
+    uint64_t waitTarget; // Usec a request waits for a segment before the pool grows
+    uint64_t idleTime; // Usec a free segment stays unused before it is parked
+    uint64_t deadline; // Usec a request may wait for a segment and the cache, 0 waits forever
+    size_t maxWaiting; // Requests per shard that may wait for a segment, 0 for no limit
+    bool isPrefault;
+    bool isNumaPlaced;
+    size_t segmentSize;
+    size_t nShards;
+    ContextShard_t shards[MAX_SHARDS];
+    HashRing_t ring;
+    int nNodes;
+    int nStripes; // Most segments a single request may use at once
+    uint64_t nextTicket;
+    char nameSpace[MAX_NAMESPACE_LEN]; // Keeps the segment names apart from other webproxies'
+    int nListeners; // Processes accepting on the port, each with its own gfserver
+    slab_t contexts; // Every shard's ContextProxy_t, a cache line each
+    bool isPinned;
+    cpu_set_t workerCpus;
 }ContextWebProxy_t;
 ContextWebProxy_t g_webProxy;
 
 typedef struct {
-    char filePath[MAX_PATH_LEN];
+    ContextWebProxy_t *webProxy;
+    int index;
+    int node; // -1 until the worker thread has been placed
+}ContextWorker_t;
+
+/*
+ * Control block of a segment. The payload starts the segment, page aligned,
+ * and this follows it. The fields the cache writes and those the proxy
+ * writes sit on cache lines of their own, so do the two handoffs.
+ */
+typedef struct {
+    // Written by the cache
+    gfstatus_t status;
     size_t fileLen;
     size_t dataLen;
-    gfstatus_t status;
-    sem_t semREAD;
-    sem_t semWRITE;
+    uint64_t finished; // Ticket of the last request the cache is done with on this segment
+    ShmHandoff_t semREAD __attribute__((aligned(CACHE_LINE))); // Posted by the cache when the segment holds data for the proxy
+    // Written by the proxy
+    uint64_t stripeTicket __attribute__((aligned(CACHE_LINE))); // Request ticket until a cache worker claims the stripe, ticket + 1 after
+    uint64_t abandoned; // Ticket of a request the proxy gave up on, the cache stops filling it
+    ShmHandoff_t semWRITE __attribute__((aligned(CACHE_LINE))); // Posted by the proxy when the cache may write the segment
 }ContextShm_t;
 
-typedef struct {
+// Where the control block of a segment carrying segmentSize payload bytes starts, and the whole segment's length
+#define SHM_CONTROL_OFFSET(segmentSize) (((segmentSize) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+#define SHM_SEGMENT_LEN(segmentSize) (SHM_CONTROL_OFFSET(segmentSize) + sizeof(ContextShm_t))
+
+struct ContextProxy_t {
     char shm_name[MAX_SHMNAME_LEN];
     ContextShm_t * shm_context;
-}ContextProxy_t;
+    char *shm_data; // Payload, at the start of the segment
+    size_t shm_offset;
+    size_t region_size;
+    int node;
+    uint64_t last_used; // shm_channel_clock_us() when last released
+    uint64_t ticket; // Request abandoned on the segment, while it waits in quarantine
+};
 
 
 typedef struct  {
   pthread_t pthread;
   bool isEnabled; // Used to kill threads and exit safe.
+  bool isStarted; // Has a thread to join, which may have retired since
+  int index;
+  int node; // NUMA node whose requests this worker serves first
 }threadInfo_t;
 
 
 void *cache_worker(void *arg);
 
+// Creates the next segment of a shard, called with growLock held (webproxy.c)
+ContextProxy_t *webproxy_add_segment(ContextShard_t *shard);
+
 
 
 #endif // __CACHE_STUDENT_H__
@@ -0,0 +1,33 @@
+#ifndef __GETFILE_RANGE_H__
+#define __GETFILE_RANGE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A GETFILE request may ask for part of a file by appending a byte range
+ * to its path, e.g. "/courses/ud923/filecorpus/road.jpg?bytes=100-199".
+ * END is inclusive and may be left out ("?bytes=100-") to read to the end
+ * of the file. The header of the reply carries the length of the slice.
+ */
+#define GF_RANGE_TAG "?bytes="
+
+typedef struct {
+    bool isRange;
+    size_t offset;
+    size_t length; // 0 means up to the end of the file
+} gfrange_t;
+
+/*
+ * Splits request into the bare path (copied into path) and its range.
+ * Requests without a range get the whole file. Returns 0 on success, -1
+ * if the range is malformed or the path does not fit in pathLen.
+ */
+int gfrange_parse(const char *request, char *path, size_t pathLen, gfrange_t *range);
+
+/*
+ * Returns how many bytes of a fileLen byte file the range covers.
+ */
+size_t gfrange_span(const gfrange_t *range, size_t fileLen);
+
+#endif // __GETFILE_RANGE_H__
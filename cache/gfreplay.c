@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gfserver.h"
+#include "gftrace.h"
+
+#define USAGE                                                                         \
+"usage:\n"                                                                            \
+"  gfreplay [options]\n"                                                              \
+"options:\n"                                                                          \
+"  -f [trace_file]     Trace recorded by webproxy -T (Required)\n"                    \
+"  -n [requests]       Replay only the first requests of the trace (Default: all)\n"  \
+"  -p [port]           Port of the webproxy (Default: 10823)\n"                       \
+"  -s [server]         Address of the webproxy (Default: localhost)\n"                \
+"  -t [thread_count]   Clients, the most requests in flight at once (Default: 64)\n"  \
+"  -x [speed]          Replay this many times faster than recorded, 0 sends as fast as possible (Default: 1)\n" \
+"  -h                  Show this help message\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+        {"trace",         required_argument,      NULL,           'f'},
+        {"requests",      required_argument,      NULL,           'n'},
+        {"port",          required_argument,      NULL,           'p'},
+        {"server",        required_argument,      NULL,           's'},
+        {"thread-count",  required_argument,      NULL,           't'},
+        {"speed",         required_argument,      NULL,           'x'},
+        {"help",          no_argument,            NULL,           'h'},
+        {NULL,            0,                      NULL,            0}
+};
+
+typedef struct {
+    gftrace_record_t record;
+    char path[MAX_REQUEST_LEN];
+    uint64_t due; // Usec after the start of the replay the request is sent at
+    uint64_t sent;
+    uint64_t done;
+    gfstatus_t status; // Of the replay, 0 if it got no valid reply
+    uint64_t bytes;
+}Replayed_t;
+
+static Replayed_t *requests;
+static size_t nRequests;
+static size_t nextRequest = 0;
+static struct addrinfo *proxyAddr;
+static uint64_t replayStart;
+
+static uint64_t _clock_us(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void _sleep_until(uint64_t at){
+    struct timespec until = {.tv_sec = at / 1000000, .tv_nsec = (at % 1000000) * 1000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+        ;
+}
+
+static int _by_arrival(const void *a, const void *b){
+    uint64_t x = ((const Replayed_t*) a)->record.arrival, y = ((const Replayed_t*) b)->record.arrival;
+    return (x > y) - (x < y);
+}
+
+static int _by_value(const void *a, const void *b){
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void _load(const char *fileName, size_t limit){
+    gftrace_header_t header;
+    gftrace_record_t record;
+    char path[MAX_REQUEST_LEN];
+    size_t cap = 1024;
+    FILE *file;
+
+    if ((file = fopen(fileName, "rb")) == NULL || gftrace_read_header(file, &header) != 0){
+        fprintf(stderr, "Unable to read trace %s\n", fileName);
+        exit(__LINE__);
+    }
+
+    requests = (Replayed_t*) malloc(cap * sizeof(Replayed_t));
+    nRequests = 0;
+    while (gftrace_read(file, &record, path, sizeof(path)) == 0){
+        if (nRequests == cap){
+            cap *= 2;
+            requests = (Replayed_t*) realloc(requests, cap * sizeof(Replayed_t));
+        }
+        memset(&requests[nRequests], 0, sizeof(Replayed_t));
+        requests[nRequests].record = record;
+        snprintf(requests[nRequests].path, sizeof(requests[nRequests].path), "%s", path);
+        nRequests++;
+    }
+    fclose(file);
+
+    // Listeners and handler threads append records as they finish, not as requests arrive
+    qsort(requests, nRequests, sizeof(Replayed_t), _by_arrival);
+    if (limit > 0 && limit < nRequests)
+        nRequests = limit;
+}
+
+// Sends one GETFILE request and reads the reply, keeping only its status and length
+static void _fetch(Replayed_t *request){
+    char buffer[65536];
+    char scheme[16], word[32];
+    size_t len = 0, fileLen = 0;
+    char *body = NULL;
+    ssize_t n;
+    int sock;
+
+    request->status = 0;
+    request->bytes = 0;
+
+    if ((sock = socket(proxyAddr->ai_family, proxyAddr->ai_socktype, proxyAddr->ai_protocol)) < 0)
+        return;
+    if (connect(sock, proxyAddr->ai_addr, proxyAddr->ai_addrlen) != 0){
+        close(sock);
+        return;
+    }
+
+    n = snprintf(buffer, sizeof(buffer), "GETFILE GET %s\r\n\r\n", request->path);
+    if (send(sock, buffer, n, MSG_NOSIGNAL) != n){
+        close(sock);
+        return;
+    }
+
+    // The header, and whatever of the body came with it
+    while (body == NULL && len < sizeof(buffer) - 1 && (n = recv(sock, buffer + len, sizeof(buffer) - 1 - len, 0)) > 0){
+        len += n;
+        buffer[len] = '\0';
+        body = strstr(buffer, "\r\n\r\n");
+    }
+    if (body == NULL || sscanf(buffer, "%15s %31s %zu", scheme, word, &fileLen) < 2 || strcmp(scheme, "GETFILE") != 0){
+        close(sock);
+        return;
+    }
+
+    if (strcmp(word, "OK") == 0){
+        request->bytes = len - (body + 4 - buffer);
+        while (request->bytes < fileLen && (n = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+            request->bytes += n;
+        // A short body is a failed transfer, like no reply at all
+        request->status = (request->bytes == fileLen) ? GF_OK : 0;
+    }
+    else if (strcmp(word, "FILE_NOT_FOUND") == 0)
+        request->status = GF_FILE_NOT_FOUND;
+    else
+        request->status = GF_ERROR;
+
+    close(sock);
+}
+
+static void *_client(void *arg){
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&nextRequest, 1, __ATOMIC_RELAXED)) < nRequests){
+        Replayed_t *request = &requests[i];
+
+        _sleep_until(replayStart + request->due);
+        request->sent = _clock_us() - replayStart;
+        _fetch(request);
+        request->done = _clock_us() - replayStart;
+    }
+    return NULL;
+}
+
+static void _print_percentiles(const char *label, uint64_t *values, size_t n){
+    static const double points[] = {0.5, 0.9, 0.99, 0.999};
+
+    qsort(values, n, sizeof(uint64_t), _by_value);
+    printf("%-20s", label);
+    for (int i = 0; i < 4; i++)
+        printf(" %10lu", (unsigned long) values[(size_t) (points[i] * (n - 1))]);
+    printf(" %10lu\n", (unsigned long) values[n - 1]);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+    int option_char = 0;
+    char *traceFile = NULL;
+    char *server = "localhost";
+    char port[8] = "10823";
+    unsigned int nthreads = 64;
+    size_t limit = 0;
+    double speed = 1.0;
+    struct addrinfo hints;
+    uint64_t first, elapsed, totalBytes = 0;
+    size_t nFailed = 0, nChanged = 0;
+
+    setbuf(stdout, NULL);
+
+    while ((option_char = getopt_long(argc, argv, "f:n:p:s:t:x:h", gLongOptions, NULL)) != -1) {
+        switch (option_char) {
+            default:
+                fprintf(stderr, "%s", USAGE);
+                exit(__LINE__);
+            case 'h': // help
+                fprintf(stdout, "%s", USAGE);
+                exit(0);
+            case 'f': // trace
+                traceFile = optarg;
+                break;
+            case 'n': // requests
+                limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'p': // port
+                snprintf(port, sizeof(port), "%s", optarg);
+                break;
+            case 's': // server
+                server = optarg;
+                break;
+            case 't': // thread-count
+                nthreads = atoi(optarg);
+                break;
+            case 'x': // speed
+                speed = atof(optarg);
+                break;
+        }
+    }
+
+    if (traceFile == NULL) {
+        fprintf(stderr, "A trace file is required\n%s", USAGE);
+        exit(__LINE__);
+    }
+
+    if ((nthreads < 1) || (nthreads > 4096)) {
+        fprintf(stderr, "Invalid number of threads\n");
+        exit(__LINE__);
+    }
+
+    if (speed < 0) {
+        fprintf(stderr, "Invalid speed\n");
+        exit(__LINE__);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(server, port, &hints, &proxyAddr) != 0) {
+        fprintf(stderr, "Unable to resolve %s:%s\n", server, port);
+        exit(__LINE__);
+    }
+
+    _load(traceFile, limit);
+    if (nRequests == 0) {
+        fprintf(stderr, "No requests in %s\n", traceFile);
+        exit(__LINE__);
+    }
+
+    // Keep the recorded gaps between arrivals, scaled by speed
+    first = requests[0].record.arrival;
+    for (size_t i = 0; i < nRequests; i++)
+        requests[i].due = (speed > 0) ? (uint64_t) ((requests[i].record.arrival - first) / speed) : 0;
+
+    printf("Replaying %zu requests over %.3f s with %u clients \n", nRequests,
+           requests[nRequests - 1].due / 1e6, nthreads);
+
+    pthread_t *clients = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+    replayStart = _clock_us();
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&clients[i], NULL, _client, NULL) != 0) {
+            fprintf(stderr, "Error creating client thread %d\n", i);
+            exit(__LINE__);
+        }
+    }
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(clients[i], NULL);
+    elapsed = _clock_us() - replayStart;
+
+    // Response is from sending the request, latency from when it was due, so waiting for a free
+    // client counts against it as it would against a real one
+    uint64_t *recorded = (uint64_t*) malloc(nRequests * sizeof(uint64_t));
+    uint64_t *response = (uint64_t*) malloc(nRequests * sizeof(uint64_t));
+    uint64_t *latency = (uint64_t*) malloc(nRequests * sizeof(uint64_t));
+    for (size_t i = 0; i < nRequests; i++) {
+        Replayed_t *request = &requests[i];
+
+        recorded[i] = request->record.service;
+        response[i] = request->done - request->sent;
+        latency[i] = request->done - request->due;
+        totalBytes += request->bytes;
+        if (request->status == 0)
+            nFailed++;
+        else if (request->status != request->record.status)
+            nChanged++;
+    }
+
+    printf("%zu requests in %.3f s, %.1f requests/s, %.2f MB/s \n", nRequests, elapsed / 1e6,
+           nRequests * 1e6 / elapsed, totalBytes / (double) elapsed);
+    printf("%zu failed, %zu answered with another status than recorded \n", nFailed, nChanged);
+    printf("%-20s %10s %10s %10s %10s %10s\n", "usec", "p50", "p90", "p99", "p99.9", "max");
+    _print_percentiles("recorded service", recorded, nRequests);
+    _print_percentiles("replay response", response, nRequests);
+    _print_percentiles("replay latency", latency, nRequests);
+
+    free(recorded);
+    free(response);
+    free(latency);
+    free(clients);
+    free(requests);
+    freeaddrinfo(proxyAddr);
+    return 0;
+}
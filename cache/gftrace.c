@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gftrace.h"
+
+#define TRACE_BUFFER (64 * 1024)
+
+static int traceFd = -1;
+static uint64_t traceStart; // CLOCK_MONOTONIC usec, arrivals count from here
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static char traceBuffer[TRACE_BUFFER];
+static size_t traceUsed = 0;
+
+static uint64_t _clock_us(clockid_t clock){
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+int gftrace_open(const char *fileName){
+    gftrace_header_t header;
+
+    if ((traceFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0)
+        return -1;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, GF_TRACE_MAGIC, sizeof(header.magic));
+    header.startTime = _clock_us(CLOCK_REALTIME);
+    traceStart = _clock_us(CLOCK_MONOTONIC);
+
+    if (write(traceFd, &header, sizeof(header)) != sizeof(header)){
+        close(traceFd);
+        traceFd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Called with the lock held. One write per buffer, O_APPEND keeps other writers' buffers whole
+static void _write_out(void){
+    if (traceUsed > 0 && write(traceFd, traceBuffer, traceUsed) != (ssize_t) traceUsed)
+        fprintf(stderr, "Trace write failed, %zu bytes of records lost: %s \n", traceUsed, strerror(errno));
+    traceUsed = 0;
+}
+
+void gftrace_record(uint64_t arrival, uint64_t service, int status, uint64_t bytes, const char *path){
+    gftrace_record_t record;
+    size_t pathLen = strlen(path);
+
+    if (traceFd < 0)
+        return;
+
+    if (pathLen > TRACE_BUFFER - sizeof(record))
+        pathLen = TRACE_BUFFER - sizeof(record);
+    record.arrival = arrival > traceStart ? arrival - traceStart : 0;
+    record.service = service > UINT32_MAX ? UINT32_MAX : (uint32_t) service;
+    record.status = status;
+    record.bytes = bytes;
+    record.pathLen = pathLen > UINT16_MAX ? UINT16_MAX : (uint16_t) pathLen;
+
+    pthread_mutex_lock(&traceLock);
+    if (traceUsed + sizeof(record) + record.pathLen > TRACE_BUFFER)
+        _write_out();
+    memcpy(traceBuffer + traceUsed, &record, sizeof(record));
+    memcpy(traceBuffer + traceUsed + sizeof(record), path, record.pathLen);
+    traceUsed += sizeof(record) + record.pathLen;
+    pthread_mutex_unlock(&traceLock);
+}
+
+void gftrace_flush(void){
+    if (traceFd < 0)
+        return;
+
+    pthread_mutex_lock(&traceLock);
+    _write_out();
+    pthread_mutex_unlock(&traceLock);
+}
+
+int gftrace_read_header(FILE *file, gftrace_header_t *header){
+    if (fread(header, sizeof(*header), 1, file) != 1)
+        return -1;
+    return memcmp(header->magic, GF_TRACE_MAGIC, sizeof(header->magic)) == 0 ? 0 : -1;
+}
+
+int gftrace_read(FILE *file, gftrace_record_t *record, char *path, size_t pathLen){
+    size_t keep;
+
+    if (fread(record, sizeof(*record), 1, file) != 1)
+        return -1;
+
+    keep = record->pathLen < pathLen ? record->pathLen : pathLen - 1;
+    if (fread(path, 1, keep, file) != keep)
+        return -1;
+    path[keep] = '\0';
+    if (keep < record->pathLen && fseek(file, record->pathLen - keep, SEEK_CUR) != 0)
+        return -1;
+    return 0;
+}
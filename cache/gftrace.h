@@ -0,0 +1,58 @@
+#ifndef __GETFILE_TRACE_H__
+#define __GETFILE_TRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * A trace is a header followed by one record per request, each record
+ * followed by the request path (with its range, not terminated). Times are
+ * in usec; arrivals count from the start of the capture, so a trace
+ * written by several listeners of one webproxy shares a single clock.
+ */
+#define GF_TRACE_MAGIC "GFTRACE1"
+
+typedef struct {
+    char magic[8];
+    uint64_t startTime; // CLOCK_REALTIME usec when the capture began
+} gftrace_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t arrival; // When the handler got the request
+    uint32_t service; // From arrival until the handler returned
+    int32_t status; // gfstatus_t of the reply, 0 if no header went out
+    uint64_t bytes; // Body bytes sent
+    uint16_t pathLen;
+} gftrace_record_t;
+
+/*
+ * Creates (or truncates) fileName and writes the header. Processes forked
+ * afterwards append to the same file. Returns 0, or -1 with errno set.
+ */
+int gftrace_open(const char *fileName);
+
+/*
+ * Queues a record for a request that arrived at shm_channel_clock_us()
+ * time arrival. Records are written out in whole buffers, appended at once,
+ * so the records of concurrent writers never interleave.
+ */
+void gftrace_record(uint64_t arrival, uint64_t service, int status, uint64_t bytes, const char *path);
+
+/*
+ * Writes out the queued records.
+ */
+void gftrace_flush(void);
+
+/*
+ * Reads the header of a trace. Returns 0, or -1 if the file is no trace.
+ */
+int gftrace_read_header(FILE *file, gftrace_header_t *header);
+
+/*
+ * Reads the next record and its path, terminated and cut to pathLen - 1
+ * bytes. Returns 0, or -1 at the end of the trace or on a truncated record.
+ */
+int gftrace_read(FILE *file, gftrace_record_t *record, char *path, size_t pathLen);
+
+#endif // __GETFILE_TRACE_H__
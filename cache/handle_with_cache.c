@@ -1,107 +1,489 @@
 #include "gfserver.h"
 #include "cache-student.h"
 
-/*
- * Placeholder demonstrates use of gfserver library, replace with your own
- * implementation and any other functions you may need.
- */
+#define ATTACH_RETRY_US 1000000 // How often a shard without a published object is checked for one
+#define REMOTE_POLL_US 1000 // How long a waiter sticks to its own node's segments before checking the others
+
+typedef bool (*object_check_t)(const void *object, size_t size);
+
+static bool _check_filter(const void *object, size_t size){
+    const ShmFilter_t *filter = (const ShmFilter_t*) object;
+
+    return size >= sizeof(ShmFilter_t) && filter->nBits > 0 && (filter->nBits & (filter->nBits - 1)) == 0 &&
+            sizeof(ShmFilter_t) + filter->nBits / 8 <= size;
+}
+
+static bool _check_index(const void *object, size_t size){
+    const ShmIndex_t *index = (const ShmIndex_t*) object;
+
+    return size >= sizeof(ShmIndex_t) && index->size == size && index->nSlots > 0 &&
+            (index->nSlots & (index->nSlots - 1)) == 0 && index->nSlots * sizeof(ShmIndexEntry_t) <= size;
+}
+
+// Maps an object the shard's cache published. Returns NULL if there is none (yet)
+static ShmMapping_t *_attach_object(const char *name, uint32_t magic, object_check_t check){
+    ShmMapping_t *mapping = NULL;
+    const ShmObject_t *object;
+    struct stat st;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ShmObject_t)){
+        void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED){
+            object = (const ShmObject_t*) addr;
+            // Reject anything half written or not laid out as expected
+            if (__atomic_load_n(&object->magic, __ATOMIC_ACQUIRE) != magic || !check(addr, st.st_size))
+                munmap(addr, st.st_size);
+            else if ((mapping = (ShmMapping_t*) malloc(sizeof(ShmMapping_t))) != NULL){
+                mapping->object = object;
+                mapping->size = st.st_size;
+                mapping->refs = 1;
+            }
+            else
+                munmap(addr, st.st_size);
+        }
+    }
+    close(fd);
+    return mapping;
+}
+
+// Called with attachLock held
+static void _unref_object(ShmMapping_t *mapping){
+    if (--mapping->refs == 0){
+        munmap((void*) mapping->object, mapping->size);
+        free(mapping);
+    }
+}
+
+// Drops a reference taken by _shard_object
+static void _put_object(ContextShard_t *shard, ShmMapping_t *mapping){
+    if (mapping == NULL)
+        return;
+    pthread_mutex_lock(&shard->attachLock);
+    _unref_object(mapping);
+    pthread_mutex_unlock(&shard->attachLock);
+}
+
+// Returns the shard's current object with a reference for the caller to drop, swapping in
+// the new one when the cache republished. A retired mapping goes with its last reader
+static ShmMapping_t *_shard_object(ContextShard_t *shard, ShmMapping_t **current, uint64_t *retry,
+                                   const char *name, uint32_t magic, object_check_t check){
+    ShmMapping_t *mapping;
+
+    pthread_mutex_lock(&shard->attachLock);
+    if ((mapping = *current) != NULL && __atomic_load_n(&mapping->object->retired, __ATOMIC_ACQUIRE)){
+        *current = NULL;
+        _unref_object(mapping);
+        mapping = NULL;
+    }
+    if (mapping == NULL && shm_channel_clock_us() >= *retry){
+        if ((mapping = _attach_object(name, magic, check)) != NULL){
+            fprintf(stdout, "Shard %d attached %s \n", shard->index, name);
+            *current = mapping;
+        }
+        else
+            *retry = shm_channel_clock_us() + ATTACH_RETRY_US;
+    }
+    if (mapping)
+        mapping->refs++;
+    pthread_mutex_unlock(&shard->attachLock);
+    return mapping;
+}
+
+static ShmMapping_t *_shard_filter(ContextShard_t *shard){
+    char name[MAX_SHMNAME_LEN];
+
+    shm_channel_filter_name(name, sizeof(name), shard->index);
+    return _shard_object(shard, &shard->filter, &shard->filterRetry, name, FILTER_MAGIC, _check_filter);
+}
+
+static ShmMapping_t *_shard_index(ContextShard_t *shard){
+    char name[MAX_SHMNAME_LEN];
+
+    shm_channel_index_name(name, sizeof(name), shard->index);
+    return _shard_object(shard, &shard->shmIndex, &shard->indexRetry, name, INDEX_MAGIC, _check_index);
+}
+
+// Pins the calling gfserver thread on its first request and records its node
+static void _place_worker(ContextWorker_t *worker){
+    ContextWebProxy_t *webProxyCxt = worker->webProxy;
+    int cpu;
+
+    if (webProxyCxt->isPinned){
+        cpu_set_t cpus;
+        cpu = shm_channel_cpuset_nth(&webProxyCxt->workerCpus, worker->index);
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            fprintf(stderr, "Failed to pin worker %d to cpu %d \n", worker->index, cpu);
+    }
+    else {
+        cpu = sched_getcpu();
+    }
+
+    worker->node = (webProxyCxt->nNodes > 1) ? shm_channel_cpu_node(cpu) % webProxyCxt->nNodes : 0;
+}
+
+// Brings back a parked segment, or creates one while the shard is below maxSegments
+static ContextProxy_t *_grow_pool(ContextShard_t *shard, ContextWebProxy_t *webProxyCxt){
+    ContextProxy_t *contxtProxy = NULL;
+
+    pthread_mutex_lock(&shard->growLock);
+    if (shard->nActive < webProxyCxt->maxSegments){
+        if ((contxtProxy = (ContextProxy_t*) ringq_trydequeue(&shard->parked)) == NULL)
+            contxtProxy = webproxy_add_segment(shard);
+        if (contxtProxy)
+            shard->nActive++;
+    }
+    pthread_mutex_unlock(&shard->growLock);
+
+    if (contxtProxy)
+        fprintf(stdout, "Shard %d grew to %zu active segments \n", shard->index, shard->nActive);
+    return contxtProxy;
+}
+
+// Dequeues a free segment, giving up at deadline (shm_channel_clock_us(), 0 waits forever)
+static ContextProxy_t *_dequeue_until(ringq_t *queue, uint64_t deadline){
+    struct timespec left;
+    uint64_t now;
+
+    if (deadline == 0)
+        return (ContextProxy_t*) ringq_dequeue(queue);
+    if ((now = shm_channel_clock_us()) >= deadline)
+        return NULL;
+    left.tv_sec = (deadline - now) / 1000000;
+    left.tv_nsec = (deadline - now) % 1000000 * 1000;
+    return (ContextProxy_t*) ringq_timeddequeue(queue, &left);
+}
+
+// Like _dequeue_until over all of the shard's nodes. Waits on the caller's node and polls the
+// others in between, so a node whose segments are all busy (or that has none) borrows them
+static ContextProxy_t *_dequeue_any_until(ContextShard_t *shard, int nNodes, int node, uint64_t deadline){
+    ContextProxy_t *contxtProxy;
+    uint64_t slice;
+
+    if (nNodes == 1)
+        return _dequeue_until(&shard->segQueue[node], deadline);
+    for(;;){
+        for(int n = 1; n < nNodes; n++){
+            if ((contxtProxy = (ContextProxy_t*) ringq_trydequeue(&shard->segQueue[(node + n) % nNodes])) != NULL)
+                return contxtProxy;
+        }
+        slice = shm_channel_clock_us() + REMOTE_POLL_US;
+        if (deadline && deadline <= slice)
+            return _dequeue_until(&shard->segQueue[node], deadline);
+        if ((contxtProxy = _dequeue_until(&shard->segQueue[node], slice)) != NULL)
+            return contxtProxy;
+    }
+}
+
+static void _release_segment(ContextShard_t *shard, ContextProxy_t *contxtProxy){
+    contxtProxy->last_used = shm_channel_clock_us();
+    ringq_enqueue(&shard->segQueue[contxtProxy->node], contxtProxy);
+}
+
+// Claims a stripe the way a cache worker would. Once that succeeds no worker ever touches
+// it for this ticket, so it can go straight back to the pool
+static bool _revoke_stripe(ContextProxy_t *stripe, uint64_t ticket){
+    return __atomic_compare_exchange_n(&stripe->shm_context->stripeTicket, &ticket, ticket + 1, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Gives up on a request: tells the cache to stop filling its segments and quarantines
+// the ones a cache worker claimed, since it may still be about to write into them
+static void _abandon(ContextShard_t *shard, ContextProxy_t **stripes, int nStripes, uint64_t ticket){
+    for(int j = 0; j < nStripes; j++){
+        ContextShm_t *shmContext = stripes[j]->shm_context;
+
+        if (_revoke_stripe(stripes[j], ticket)){
+            _release_segment(shard, stripes[j]);
+            continue;
+        }
+
+        stripes[j]->ticket = ticket;
+        __atomic_store_n(&shmContext->abandoned, ticket, __ATOMIC_RELEASE);
+        shm_channel_handoff_post(&shmContext->semWRITE); // Wakes a worker waiting for its turn
+        ringq_enqueue(&shard->quarantine, stripes[j]);
+    }
+}
+
+// Returns quarantined segments to the pool once the cache is done with their request.
+// Their semaphores may hold posts nobody took, so they start over
+static void _reclaim(ContextShard_t *shard){
+    size_t nQuarantined = ringq_size(&shard->quarantine);
+
+    for(size_t i = 0; i < nQuarantined; i++){
+        ContextProxy_t *contxtProxy = (ContextProxy_t*) ringq_trydequeue(&shard->quarantine);
+        ContextShm_t *shmContext;
+
+        if (contxtProxy == NULL)
+            break;
+        shmContext = contxtProxy->shm_context;
+        if (__atomic_load_n(&shmContext->finished, __ATOMIC_ACQUIRE) != contxtProxy->ticket){
+            ringq_enqueue(&shard->quarantine, contxtProxy);
+            continue;
+        }
+
+        shm_channel_handoff_init(&shmContext->semREAD, 0);
+        shm_channel_handoff_init(&shmContext->semWRITE, 1);
+        fprintf(stdout, "Shard %d reclaimed segment %s \n", shard->index, contxtProxy->shm_name);
+        _release_segment(shard, contxtProxy);
+    }
+}
+
+// Takes a free segment, preferring the ones placed on the caller's node.
+// Returns NULL at the deadline, or right away when too many requests are waiting already
+static ContextProxy_t *_acquire_segment(ContextShard_t *shard, ContextWebProxy_t *webProxyCxt, int node, uint64_t deadline){
+    ContextProxy_t *contxtProxy = NULL;
+    int nNodes = webProxyCxt->nNodes;
+    uint64_t growAt;
+
+    if (!ringq_isempty(&shard->quarantine))
+        _reclaim(shard);
+
+    for(int n = 0; n < nNodes; n++){
+        if ((contxtProxy = (ContextProxy_t*) ringq_trydequeue(&shard->segQueue[(node + n) % nNodes])) != NULL)
+            return contxtProxy;
+    }
+
+    // Shed load rather than queue up behind a backlog that can't drain in time
+    if (__atomic_add_fetch(&shard->nWaiting, 1, __ATOMIC_RELAXED) > webProxyCxt->maxWaiting && webProxyCxt->maxWaiting > 0){
+        __atomic_sub_fetch(&shard->nWaiting, 1, __ATOMIC_RELAXED);
+        fprintf(stderr, "Shard %d is overloaded, failing the request \n", shard->index);
+        return NULL;
+    }
+
+    // Everything is busy, wait for a segment to come back, our own node's first. Waiting
+    // longer than the target means the pool is too small for the load
+    if (shard->nActive < webProxyCxt->maxSegments){
+        growAt = shm_channel_clock_us() + webProxyCxt->waitTarget;
+        if ((contxtProxy = _dequeue_any_until(shard, nNodes, node, (deadline && deadline < growAt) ? deadline : growAt)) == NULL)
+            contxtProxy = _grow_pool(shard, webProxyCxt);
+    }
+    if (contxtProxy == NULL && (contxtProxy = _dequeue_any_until(shard, nNodes, node, deadline)) == NULL)
+        fprintf(stderr, "Shard %d had no free segment in time \n", shard->index);
+
+    __atomic_sub_fetch(&shard->nWaiting, 1, __ATOMIC_RELAXED);
+    return contxtProxy;
+}
+
+// Waits for the cache to hand the segment over, giving up at deadline (0 waits forever)
+static bool _wait_cache(ContextShm_t *shmContext, uint64_t deadline){
+    return shm_channel_handoff_wait(&shmContext->semREAD, deadline) == 0;
+}
+
+static uint64_t _step_deadline(ContextWebProxy_t *webProxyCxt){
+    return webProxyCxt->deadline ? shm_channel_clock_us() + webProxyCxt->deadline : 0;
+}
+
+// mq_send, giving up at deadline once the queue is full
+static int _send_request(mqd_t mqRequest, MSQRequest_t *cache_req, uint64_t deadline){
+    struct timespec at;
+    uint64_t now;
+
+    if (deadline == 0)
+        return mq_send(mqRequest, (const char *) cache_req, sizeof(MSQRequest_t), 0);
+
+    // mq_timedsend only takes CLOCK_REALTIME
+    now = shm_channel_clock_us();
+    clock_gettime(CLOCK_REALTIME, &at);
+    at.tv_sec += (deadline > now ? deadline - now : 0) / 1000000;
+    at.tv_nsec += (deadline > now ? deadline - now : 0) % 1000000 * 1000;
+    if (at.tv_nsec >= 1000000000){
+        at.tv_sec++;
+        at.tv_nsec -= 1000000000;
+    }
+    return mq_timedsend(mqRequest, (const char *) cache_req, sizeof(MSQRequest_t), 0, &at);
+}
+
+// Grabs up to max - 1 more free segments of the shard without waiting for any
+static int _acquire_stripes(ContextShard_t *shard, ContextProxy_t **stripes, int max, int nNodes){
+    int n = 1;
+
+    for(int node = 0; node < nNodes && n < max; node++){
+        while (n < max && (stripes[n] = (ContextProxy_t*) ringq_trydequeue(&shard->segQueue[node])) != NULL)
+            n++;
+    }
+    return n;
+}
+
 ssize_t handle_with_cache(gfcontext_t *ctx, const char *path, void* arg){
     size_t bytes_transferred = 0;
-    ContextWebProxy_t *webProxyCxt = (ContextWebProxy_t *) arg;
-    void* shmDataAddr;
+    ContextWorker_t *worker = (ContextWorker_t *) arg;
+    ContextWebProxy_t *webProxyCxt = worker->webProxy;
+    ContextProxy_t *stripes[MAX_STRIPES];
+    ContextShm_t *shmContext;
     MSQRequest_t cache_req;
+    gfrange_t range;
+    size_t fileLen = 0, nChunks = 0;
+    int nStripes = 0;
+    // The request has one deadline to get a segment and the header, then as long again per chunk
+    uint64_t deadline = webProxyCxt->deadline ? shm_channel_clock_us() + webProxyCxt->deadline : 0;
+
+    if (worker->node < 0)
+        _place_worker(worker);
+
+    // Split off the byte range, the cache only knows bare paths
+    if (gfrange_parse(path, cache_req.filePath, sizeof(cache_req.filePath), &range) != 0){
+        fprintf(stderr, "Malformed request %s \n", path);
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    }
 
-    //Pop request from the queue
-    pthread_mutex_lock(&proxy_lock->mutex);
-    while(steque_isempty(proxy_queue)){
-        pthread_cond_wait(&proxy_lock->cond, &proxy_lock->mutex);
+    // Route the path to its cache shard
+    ContextShard_t *shard = &webProxyCxt->shards[shm_channel_ring_lookup(&webProxyCxt->ring, cache_req.filePath)];
+
+    if (shard->mqRequest < 0){
+        fprintf(stderr, "shard->mqRequest is invalid\n");
+        return SERVER_FAILURE;
     }
-    ContextProxy_t * contxtProxy = (ContextProxy_t*) steque_pop(proxy_queue);
-    pthread_mutex_unlock(&proxy_lock->mutex);
 
-    if(contxtProxy == NULL){
-        fprintf(stdout, "Failed to read request queue in current thread\n");
-        goto EXIT;
+    // Keys the filter rejects are not in the cache, answer without a round trip
+    ShmMapping_t *filter = _shard_filter(shard);
+    bool isFiltered = filter && !shm_channel_filter_contains((const ShmFilter_t*) filter->object, cache_req.filePath);
+    _put_object(shard, filter);
+    if (isFiltered){
+        fprintf(stdout, "Filtered miss %s \n", cache_req.filePath);
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
     }
 
+    // Hits on published bodies are sent straight from the shared mapping
+    ShmMapping_t *mapping = _shard_index(shard);
+    const ShmIndex_t *index = mapping ? (const ShmIndex_t*) mapping->object : NULL;
+    const ShmIndexEntry_t *entry = index ? shm_channel_index_find(index, cache_req.filePath) : NULL;
+    if (entry){
+        fileLen = gfrange_span(&range, entry->size);
+        gfs_sendheader(ctx, GF_OK, fileLen);
+        if (fileLen > 0 && gfs_send(ctx, (void*) ((const char*) index + entry->data + range.offset), fileLen) != (ssize_t) fileLen){
+            fprintf(stderr, "gfs_send write error\n");
+            _put_object(shard, mapping);
+            return SERVER_FAILURE;
+        }
+        fprintf(stdout, "Shared hit %s: %zu bytes from index version %lu \n",
+                cache_req.filePath, fileLen, (unsigned long) index->version);
+        _put_object(shard, mapping);
+        return fileLen;
+    }
+    _put_object(shard, mapping);
 
-    sprintf(cache_req.filePath, "%s", path);
+    //Pop request from the queue, then borrow whatever else is idle for the stripes
+    if ((stripes[0] = _acquire_segment(shard, webProxyCxt, worker->node, deadline)) == NULL)
+        return gfs_sendheader(ctx, GF_ERROR, 0);
+    nStripes = _acquire_stripes(shard, stripes, webProxyCxt->nStripes, webProxyCxt->nNodes);
+
+    cache_req.offset = range.offset;
+    cache_req.length = range.length;
     cache_req.nSegments = webProxyCxt->nSegments;
     cache_req.segmentSize = webProxyCxt->segmentSize;
-    strcpy(cache_req.shmName, contxtProxy->shm_name);
+    strcpy(cache_req.shmName, stripes[0]->shm_name);
+    cache_req.shmOffset = stripes[0]->shm_offset;
+    cache_req.regionSize = stripes[0]->region_size;
+    cache_req.node = stripes[0]->node;
+    cache_req.stripe = 0;
+    cache_req.nStripes = nStripes;
+    cache_req.ticket = __atomic_add_fetch(&webProxyCxt->nextTicket, 2, __ATOMIC_RELAXED);
+    for(int j = 0; j < nStripes; j++){
+        stripes[j]->shm_context->stripeTicket = cache_req.ticket;
+        if (j > 0){
+            strcpy(cache_req.stripes[j - 1].shmName, stripes[j]->shm_name);
+            cache_req.stripes[j - 1].shmOffset = stripes[j]->shm_offset;
+        }
+    }
 
-    if (webProxyCxt->mqRequest < 0){
-        fprintf(stderr, "webProxyCxt->mqResponse is invalid\n");
-        return SERVER_FAILURE;
+    fprintf(stdout, "cache_req.filePath %s over %d stripes \n", cache_req.filePath, nStripes);
+    if (_send_request(shard->mqRequest, &cache_req, deadline) == -1){
+        int errCode = errno;
+        fprintf(stderr, "mq_send failed with errCode : %d shard->mqRequest %d \n", errCode, shard->mqRequest);
+        for(int j = 0; j < nStripes; j++)
+            _release_segment(shard, stripes[j]);
+        return (errCode == ETIMEDOUT) ? gfs_sendheader(ctx, GF_ERROR, 0) : SERVER_FAILURE;
     }
 
-    fprintf(stdout, "cache_req.filePath %s \n", cache_req.filePath);
-    if (mq_send(webProxyCxt->mqRequest, (const char *) &cache_req, sizeof(MSQRequest_t), 0) == -1){
-        fprintf(stderr, "mq_send failed with errCode : %d webProxyCxt->mqRequest %d \n", errno, webProxyCxt->mqRequest);
-        bytes_transferred = 0;
-        return SERVER_FAILURE;
+    // Lock semaphores for reading, every stripe carries the same status and length
+    shmContext = stripes[0]->shm_context;
+    if (!_wait_cache(shmContext, deadline)){
+        fprintf(stderr, "Cache missed the deadline for %s \n", cache_req.filePath);
+        _abandon(shard, stripes, nStripes, cache_req.ticket);
+        return gfs_sendheader(ctx, GF_ERROR, 0);
     }
 
-    // Lock semaphores for reading
-    sem_wait(&contxtProxy->shm_context->semREAD);
+    if (shmContext->status == GF_OK){ /*GF_OK*/
+        size_t chunkSize = webProxyCxt->segmentSize;
 
-    if (contxtProxy->shm_context->status == GF_OK){ /*GF_OK*/
-        fprintf(stdout, "Posting gf_sendheader GF_OK file with filelen %zu \n", contxtProxy->shm_context->fileLen);
-        gfs_sendheader(ctx, GF_OK, contxtProxy->shm_context->fileLen);
+        fileLen = shmContext->fileLen;
+        nChunks = (fileLen + chunkSize - 1) / chunkSize;
+        fprintf(stdout, "Posting gf_sendheader GF_OK file with filelen %zu \n", fileLen);
+        gfs_sendheader(ctx, GF_OK, fileLen);
 
-        size_t write_len = 0;
-        bytes_transferred = 0;
-        while(bytes_transferred < contxtProxy->shm_context->fileLen){
-            if (contxtProxy->shm_context->dataLen <= 0){
-                fprintf(stderr, "handle_with_cache read error, %zd, %zu, %zu",
-                        contxtProxy->shm_context->dataLen, bytes_transferred,contxtProxy->shm_context->fileLen);
+        // Chunk k sits in stripe k % nStripes, the first one has been waited for already
+        for(size_t k = 0; k < nChunks; k++){
+            size_t write_len;
+
+            ContextProxy_t *stripe = stripes[k % nStripes];
+
+            shmContext = stripe->shm_context;
+            if (k > 0 && !_wait_cache(shmContext, _step_deadline(webProxyCxt))){
+                fprintf(stderr, "Cache stalled on %s after %zu bytes \n", cache_req.filePath, bytes_transferred);
+                _abandon(shard, stripes, nStripes, cache_req.ticket);
                 return SERVER_FAILURE;
             }
 
-            shmDataAddr = contxtProxy->shm_context + 1;
-            char localBuf[contxtProxy->shm_context->dataLen];
-
-            memcpy(&localBuf, shmDataAddr, contxtProxy->shm_context->dataLen); // Copy only read length not segSize - sizeof(ContextShm_t) here, writer takes care of writing only that calculated amount.
+            if (shmContext->dataLen <= 0){
+                fprintf(stderr, "handle_with_cache read error, %zd, %zu, %zu",
+                        shmContext->dataLen, bytes_transferred, fileLen);
+                _abandon(shard, stripes, nStripes, cache_req.ticket);
+                return SERVER_FAILURE;
+            }
 
-            write_len = gfs_send(ctx, &localBuf, contxtProxy->shm_context->dataLen);
+            write_len = gfs_send(ctx, stripe->shm_data, shmContext->dataLen);
 
-            if (write_len != contxtProxy->shm_context->dataLen){
+            if (write_len != shmContext->dataLen){
                 fprintf(stderr, "gfs_send write error\n");
+                _abandon(shard, stripes, nStripes, cache_req.ticket);
                 return SERVER_FAILURE;
             }
 
             bytes_transferred += write_len;
 
             // give turn to writer
-            sem_post(&contxtProxy->shm_context->semWRITE);
-
-            //wait for next read turn
-            sem_wait(&contxtProxy->shm_context->semREAD);
-
+            shm_channel_handoff_post(&shmContext->semWRITE);
         }
     }
+    else if (shmContext->status == GF_ERROR){
+        // The cache couldn't map every stripe and answered on the first alone
+        fprintf(stderr, "Cache failed %s \n", cache_req.filePath);
+        gfs_sendheader(ctx, GF_ERROR, 0);
+        for(int j = 1; j < nStripes; j++){
+            if (_revoke_stripe(stripes[j], cache_req.ticket))
+                _release_segment(shard, stripes[j]);
+            else
+                _abandon(shard, &stripes[j], 1, cache_req.ticket);
+        }
+        nStripes = 1;
+    }
     else{
         fprintf(stdout, "Posting gfs_sendheader GF_FILE_NOT_FOUND\n");
         gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
     }
 
-
-    //Post it to writer to go with another request now
-    sem_post(&contxtProxy->shm_context->semWRITE);
-
-    // Release shared memory for other threads
-    EXIT:
-    fprintf(stdout, "Release SHM: bytes_transferred: %zu FileLen: %zu FilePath %s \n", bytes_transferred, contxtProxy->shm_context->fileLen, contxtProxy->shm_context->filePath);
-    if (proxy_queue){
-        contxtProxy->shm_context->fileLen = 0;
-        bzero(contxtProxy->shm_context->filePath, MAX_PATH_LEN);
-        contxtProxy->shm_context->dataLen = 0;
-
-        pthread_mutex_lock(&proxy_lock->mutex);
-        steque_enqueue(proxy_queue, contxtProxy);
-        pthread_mutex_unlock(&proxy_lock->mutex);
-        pthread_cond_broadcast(&proxy_lock->cond);
+    //Wait for every writer to finish, then post it to go with another request now
+    for(int j = 0; j < nStripes; j++){
+        shmContext = stripes[j]->shm_context;
+        if ((j > 0 || nChunks > 0) && !_wait_cache(shmContext, _step_deadline(webProxyCxt))){
+            fprintf(stderr, "Cache stalled finishing %s \n", cache_req.filePath);
+            _abandon(shard, stripes, nStripes, cache_req.ticket);
+            return bytes_transferred;
+        }
     }
+    for(int j = 0; j < nStripes; j++)
+        shm_channel_handoff_post(&stripes[j]->shm_context->semWRITE);
+
+    // Release shared memory for other threads. The cache sets the lengths before every post,
+    // clearing them here would only pull its cache line over
+    fprintf(stdout, "Release SHM: bytes_transferred: %zu FileLen: %zu FilePath %s \n", bytes_transferred, fileLen, cache_req.filePath);
+    for(int j = 0; j < nStripes; j++)
+        _release_segment(shard, stripes[j]);
 
     return bytes_transferred;
 }
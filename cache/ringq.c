@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "ringq.h"
+
+#if !defined(RINGQ_FAILURE)
+#define RINGQ_FAILURE (-1)
+#endif // RINGQ_FAILURE
+
+static void _futex_wait(uint32_t* word, uint32_t expected){
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void _futex_wake(uint32_t* word, int nwaiters){
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, nwaiters, NULL, NULL, 0);
+}
+
+/* Bumps the event word and wakes one waiter, if anybody is parked on it */
+static void _signal(uint32_t* word, uint32_t* waiters){
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST) > 0){
+    __atomic_fetch_add(word, 1, __ATOMIC_SEQ_CST);
+    _futex_wake(word, 1);
+  }
+}
+
+void ringq_init(ringq_t* this, size_t capacity){
+  size_t size = 2;
+
+  while(size < capacity)
+    size <<= 1;
+
+  this->cells = (ringq_cell_t*) malloc(size * sizeof(ringq_cell_t));
+  if(this->cells == NULL){
+    fprintf(stderr, "Error: unable to allocate ringq of %zu slots.\n", size);
+    fflush(stderr);
+    exit(RINGQ_FAILURE);
+  }
+
+  for(size_t i = 0; i < size; i++){
+    this->cells[i].seq = i;
+    this->cells[i].item = NULL;
+  }
+
+  this->mask = size - 1;
+  this->head = 0;
+  this->tail = 0;
+  this->notEmpty = 0;
+  this->notFull = 0;
+  this->popWaiters = 0;
+  this->pushWaiters = 0;
+  this->closed = 0;
+}
+
+size_t ringq_capacity(ringq_t* this){
+  return this->mask + 1;
+}
+
+size_t ringq_size(ringq_t* this){
+  size_t tail = __atomic_load_n(&this->tail, __ATOMIC_ACQUIRE);
+  size_t head = __atomic_load_n(&this->head, __ATOMIC_ACQUIRE);
+
+  return head > tail ? head - tail : 0;
+}
+
+int ringq_isempty(ringq_t* this){
+  return ringq_size(this) == 0;
+}
+
+int ringq_tryenqueue(ringq_t* this, ringq_item item){
+  ringq_cell_t* cell;
+  size_t pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+
+  for(;;){
+    cell = &this->cells[pos & this->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+    if(dif == 0){
+      if(__atomic_compare_exchange_n(&this->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(dif < 0)
+      return -1;
+    else
+      pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+  }
+
+  cell->item = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  _signal(&this->notEmpty, &this->popWaiters);
+  return 0;
+}
+
+ringq_item ringq_trydequeue(ringq_t* this){
+  ringq_cell_t* cell;
+  ringq_item item;
+  size_t pos = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+
+  for(;;){
+    cell = &this->cells[pos & this->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+
+    if(dif == 0){
+      if(__atomic_compare_exchange_n(&this->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(dif < 0)
+      return NULL;
+    else
+      pos = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+  }
+
+  item = cell->item;
+  __atomic_store_n(&cell->seq, pos + this->mask + 1, __ATOMIC_RELEASE);
+
+  _signal(&this->notFull, &this->pushWaiters);
+  return item;
+}
+
+int ringq_enqueue(ringq_t* this, ringq_item item){
+  while(ringq_tryenqueue(this, item) != 0){
+    uint32_t event = __atomic_load_n(&this->notFull, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&this->closed, __ATOMIC_SEQ_CST))
+      return -1;
+
+    /* Announce ourselves before the last check so a consumer can't miss us */
+    __atomic_fetch_add(&this->pushWaiters, 1, __ATOMIC_SEQ_CST);
+    if(ringq_tryenqueue(this, item) == 0){
+      __atomic_fetch_sub(&this->pushWaiters, 1, __ATOMIC_SEQ_CST);
+      return 0;
+    }
+    _futex_wait(&this->notFull, event);
+    __atomic_fetch_sub(&this->pushWaiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return 0;
+}
+
+ringq_item ringq_dequeue(ringq_t* this){
+  ringq_item item;
+
+  while((item = ringq_trydequeue(this)) == NULL){
+    uint32_t event = __atomic_load_n(&this->notEmpty, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&this->closed, __ATOMIC_SEQ_CST))
+      return NULL;
+
+    __atomic_fetch_add(&this->popWaiters, 1, __ATOMIC_SEQ_CST);
+    if((item = ringq_trydequeue(this)) != NULL){
+      __atomic_fetch_sub(&this->popWaiters, 1, __ATOMIC_SEQ_CST);
+      return item;
+    }
+    _futex_wait(&this->notEmpty, event);
+    __atomic_fetch_sub(&this->popWaiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return item;
+}
+
+ringq_item ringq_timeddequeue(ringq_t* this, const struct timespec* timeout){
+  struct timespec now, left;
+  ringq_item item;
+  int64_t deadline;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  deadline = (now.tv_sec + timeout->tv_sec) * 1000000000LL + now.tv_nsec + timeout->tv_nsec;
+
+  while((item = ringq_trydequeue(this)) == NULL){
+    uint32_t event = __atomic_load_n(&this->notEmpty, __ATOMIC_SEQ_CST);
+    int64_t remaining;
+
+    if(__atomic_load_n(&this->closed, __ATOMIC_SEQ_CST))
+      return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining = deadline - (now.tv_sec * 1000000000LL + now.tv_nsec);
+    if(remaining <= 0)
+      return NULL;
+    left.tv_sec = remaining / 1000000000LL;
+    left.tv_nsec = remaining % 1000000000LL;
+
+    __atomic_fetch_add(&this->popWaiters, 1, __ATOMIC_SEQ_CST);
+    if((item = ringq_trydequeue(this)) != NULL){
+      __atomic_fetch_sub(&this->popWaiters, 1, __ATOMIC_SEQ_CST);
+      return item;
+    }
+    syscall(SYS_futex, &this->notEmpty, FUTEX_WAIT_PRIVATE, event, &left, NULL, 0);
+    __atomic_fetch_sub(&this->popWaiters, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return item;
+}
+
+void ringq_close(ringq_t* this){
+  __atomic_store_n(&this->closed, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&this->notEmpty, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&this->notFull, 1, __ATOMIC_SEQ_CST);
+  _futex_wake(&this->notEmpty, INT_MAX);
+  _futex_wake(&this->notFull, INT_MAX);
+}
+
+void ringq_destroy(ringq_t* this){
+  free(this->cells);
+  this->cells = NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef RINGQ_H
+#define RINGQ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef void* ringq_item;
+
+typedef struct{
+  size_t seq;
+  ringq_item item;
+} ringq_cell_t;
+
+/*
+ * Bounded multi-producer multi-consumer ring. The try functions are
+ * lock-free; the blocking ones park on a futex only when the ring is
+ * empty (or full) and are woken by the opposite side. No memory is
+ * allocated after ringq_init.
+ */
+typedef struct{
+  ringq_cell_t* cells;
+  size_t mask;
+  char pad0[64];
+  size_t head;           /* next slot to enqueue */
+  char pad1[64];
+  size_t tail;           /* next slot to dequeue */
+  char pad2[64];
+  uint32_t notEmpty;     /* futex words, bumped on every wakeup */
+  uint32_t notFull;
+  uint32_t popWaiters;
+  uint32_t pushWaiters;
+  int closed;
+} ringq_t;
+
+/* Initializes the ring to hold at least capacity items */
+void ringq_init(ringq_t* this, size_t capacity);
+
+/* Returns the number of slots in the ring */
+size_t ringq_capacity(ringq_t* this);
+
+/* Returns the number of elements in the ring (a snapshot under concurrency) */
+size_t ringq_size(ringq_t* this);
+
+/* Return 1 if empty, 0 otherwise */
+int ringq_isempty(ringq_t* this);
+
+/* Adds a non NULL item to the back. Returns 0, or -1 if the ring is full */
+int ringq_tryenqueue(ringq_t* this, ringq_item item);
+
+/* Removes the item at the front. Returns NULL if the ring is empty */
+ringq_item ringq_trydequeue(ringq_t* this);
+
+/* Adds a non NULL item to the back, waiting while the ring is full.
+   Returns 0, or -1 if the ring was closed while waiting */
+int ringq_enqueue(ringq_t* this, ringq_item item);
+
+/* Removes the item at the front, waiting while the ring is empty.
+   Returns NULL once the ring is closed and drained */
+ringq_item ringq_dequeue(ringq_t* this);
+
+/* Like ringq_dequeue, giving up after timeout.
+   Returns NULL on timeout, or once the ring is closed and drained */
+ringq_item ringq_timeddequeue(ringq_t* this, const struct timespec* timeout);
+
+/* Closes the ring and wakes every thread blocked on it */
+void ringq_close(ringq_t* this);
+
+/* Frees the slots. Items still queued are not touched */
+void ringq_destroy(ringq_t* this);
+
+#endif
@@ -1 +1,570 @@
 /* In case you want to implement the shared memory IPC as a library... */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "cache-student.h"
+#include "shm_channel.h"
+
+#if !defined(MPOL_BIND)
+#define MPOL_BIND 2
+#endif // MPOL_BIND
+
+#define ATTACH_BUCKETS 256
+
+typedef struct attachment_t{
+    char name[MAX_SHMNAME_LEN];
+    void *base;
+    size_t size;
+    int refs; // Requests using the mapping
+    bool isDetached; // No longer found by name, unmapped once refs drops to 0
+    struct attachment_t *next;
+} attachment_t;
+
+static attachment_t *attachments[ATTACH_BUCKETS];
+static pthread_mutex_t attachLock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t shm_channel_hash(const char *str){
+    uint32_t hash = 2166136261u;
+    while (*str){
+        hash ^= (unsigned char) *str++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void shm_channel_mq_name(char *buf, size_t len, int shard){
+    if (shard == 0)
+        snprintf(buf, len, "%s", MQ_REQUEST_NAME);
+    else
+        snprintf(buf, len, "%s.%d", MQ_REQUEST_NAME, shard);
+}
+
+void shm_channel_segment_name(char *buf, size_t len, const char *nameSpace, int shard, int index){
+    snprintf(buf, len, "%s%s_%d_%d", SHM_NAME, nameSpace, shard, index);
+}
+
+void shm_channel_namespace_prefix(char *buf, size_t len, const char *nameSpace){
+    snprintf(buf, len, "%s%s_", SHM_NAME, nameSpace);
+}
+
+static int _pointcmp(const void *a, const void *b){
+    uint32_t ha = ((RingPoint_t*) a)->hash;
+    uint32_t hb = ((RingPoint_t*) b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+void shm_channel_ring_init(HashRing_t *ring, int nShards){
+    char vnode[MAX_SHMNAME_LEN];
+
+    ring->nPoints = 0;
+    for (int s = 0; s < nShards; s++){
+        for (int v = 0; v < SHARD_VNODES; v++){
+            snprintf(vnode, sizeof(vnode), "shard-%d#%d", s, v);
+            ring->points[ring->nPoints].hash = shm_channel_hash(vnode);
+            ring->points[ring->nPoints].shard = s;
+            ring->nPoints++;
+        }
+    }
+    qsort(ring->points, ring->nPoints, sizeof(RingPoint_t), _pointcmp);
+}
+
+int shm_channel_ring_lookup(const HashRing_t *ring, const char *path){
+    uint32_t hash = shm_channel_hash(path);
+    size_t lo = 0, hi = ring->nPoints;
+
+    if (ring->nPoints == 0)
+        return 0;
+
+    // First point clockwise from the key, wrapping around to the start
+    while (lo < hi){
+        size_t mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < hash) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == ring->nPoints)
+        lo = 0;
+    return ring->points[lo].shard;
+}
+
+int shm_channel_parse_cpuset(const char *spec, cpu_set_t *set){
+    char buf[MAX_PATH_LEN];
+    char *ptr, *tok;
+
+    CPU_ZERO(set);
+
+    if (strncmp(spec, "node:", 5) == 0){
+        // Take the cpu list of the NUMA node from sysfs
+        char path[MAX_PATH_LEN];
+        FILE *fp;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", atoi(spec + 5));
+        if ((fp = fopen(path, "r")) == NULL){
+            fprintf(stderr, "Unable to read %s \n", path);
+            return -1;
+        }
+        if (fgets(buf, sizeof(buf), fp) == NULL){
+            fclose(fp);
+            return -1;
+        }
+        fclose(fp);
+        buf[strcspn(buf, "\n")] = '\0';
+    }
+    else {
+        snprintf(buf, sizeof(buf), "%s", spec);
+    }
+
+    ptr = buf;
+    while ((tok = strsep(&ptr, ",")) != NULL){
+        char *end;
+        long first = strtol(tok, &end, 10);
+        long last = first;
+
+        if (end == tok)
+            return -1;
+        if (*end == '-'){
+            char *dash = end + 1;
+            last = strtol(dash, &end, 10);
+            if (end == dash)
+                return -1;
+        }
+        if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+            return -1;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+    }
+
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int shm_channel_numa_nodes(void){
+    FILE *fp;
+    int first = 0, last = 0;
+
+    if ((fp = fopen("/sys/devices/system/node/possible", "r")) == NULL)
+        return 1;
+    if (fscanf(fp, "%d-%d", &first, &last) < 2)
+        last = first;
+    fclose(fp);
+
+    if (last + 1 > MAX_NUMA_NODES)
+        return MAX_NUMA_NODES;
+    return last + 1;
+}
+
+int shm_channel_cpu_node(int cpu){
+    char path[MAX_PATH_LEN];
+    struct dirent *entry;
+    DIR *dir;
+    int node = 0;
+
+    // The cpu directory holds a "nodeN" link to the node it belongs to
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if ((dir = opendir(path)) == NULL)
+        return 0;
+    while ((entry = readdir(dir)) != NULL){
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9'){
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node < MAX_NUMA_NODES ? node : 0;
+}
+
+int shm_channel_cpuset_nth(const cpu_set_t *set, int index){
+    int count = CPU_COUNT(set);
+    int seen = 0;
+
+    if (count == 0)
+        return -1;
+    index %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if (CPU_ISSET(cpu, set) && seen++ == index)
+            return cpu;
+    }
+    return -1;
+}
+
+int shm_channel_bind_node(void *addr, size_t len, int node){
+    unsigned long nodemask = 1UL << node;
+
+    if (syscall(SYS_mbind, addr, len, MPOL_BIND, &nodemask, sizeof(nodemask) * 8, 0) != 0){
+        fprintf(stderr, "mbind to node %d failed with error %s \n", node, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+size_t shm_channel_hugepage_size(void){
+    char line[MAX_PATH_LEN];
+    size_t kbytes = 0;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/meminfo", "r")) != NULL){
+        while (fgets(line, sizeof(line), fp)){
+            if (sscanf(line, "Hugepagesize: %zu kB", &kbytes) == 1)
+                break;
+        }
+        fclose(fp);
+    }
+    return kbytes ? kbytes * 1024 : 2 * 1024 * 1024;
+}
+
+void shm_channel_filter_name(char *buf, size_t len, int shard){
+    snprintf(buf, len, "%sFILTER_%d", SHM_NAME, shard);
+}
+
+static uint64_t _hash64(const char *str){
+    uint64_t hash = 14695981039346656037ULL;
+    while (*str){
+        hash ^= (unsigned char) *str++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t _filter_bits(size_t nKeys){
+    uint64_t nBits = 4096;
+    while (nBits < nKeys * FILTER_BITS_PER_KEY)
+        nBits <<= 1;
+    return nBits;
+}
+
+size_t shm_channel_filter_size(size_t nKeys){
+    return sizeof(ShmFilter_t) + _filter_bits(nKeys) / 8;
+}
+
+void shm_channel_filter_init(ShmFilter_t *filter, size_t nKeys){
+    filter->object.magic = 0;
+    filter->object.retired = 0;
+    filter->nBits = _filter_bits(nKeys);
+    filter->nKeys = 0;
+    memset(filter->bits, 0, filter->nBits / 8);
+}
+
+// Double hashing: probe i lands on h1 + i * h2
+void shm_channel_filter_add(ShmFilter_t *filter, const char *key){
+    uint64_t hash = _hash64(key);
+    uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+
+    for (int i = 0; i < FILTER_HASHES; i++){
+        uint64_t bit = (h1 + i * h2) & (filter->nBits - 1);
+        filter->bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+    filter->nKeys++;
+}
+
+bool shm_channel_filter_contains(const ShmFilter_t *filter, const char *key){
+    uint64_t hash = _hash64(key);
+    uint64_t h1 = hash, h2 = (hash >> 32) | 1;
+
+    for (int i = 0; i < FILTER_HASHES; i++){
+        uint64_t bit = (h1 + i * h2) & (filter->nBits - 1);
+        if ((filter->bits[bit / 64] & (1ULL << (bit % 64))) == 0)
+            return false;
+    }
+    return true;
+}
+
+void shm_channel_index_name(char *buf, size_t len, int shard){
+    snprintf(buf, len, "%sINDEX_%d", SHM_NAME, shard);
+}
+
+static size_t _index_slots(size_t nKeys){
+    size_t nSlots = 16;
+    while (nSlots < nKeys * 2)
+        nSlots <<= 1;
+    return nSlots;
+}
+
+static size_t _index_align(size_t len){
+    return (len + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+}
+
+size_t shm_channel_index_size(size_t nKeys, size_t dataLen){
+    return _index_align(sizeof(ShmIndex_t) + _index_slots(nKeys) * sizeof(ShmIndexEntry_t)) + dataLen;
+}
+
+void shm_channel_index_init(ShmIndex_t *index, size_t nKeys, size_t size, uint64_t version){
+    index->object.magic = 0;
+    index->object.retired = 0;
+    index->version = version;
+    index->nSlots = _index_slots(nKeys);
+    index->nEntries = 0;
+    index->size = size;
+    index->used = _index_align(sizeof(ShmIndex_t) + index->nSlots * sizeof(ShmIndexEntry_t));
+    memset(index->slots, 0, index->nSlots * sizeof(ShmIndexEntry_t));
+}
+
+uint64_t shm_channel_index_alloc(ShmIndex_t *index, size_t len){
+    uint64_t offset = index->used;
+
+    if (_index_align(len) > index->size - index->used)
+        return 0;
+    index->used += _index_align(len);
+    return offset;
+}
+
+int shm_channel_index_insert(ShmIndex_t *index, const char *key, uint64_t data, uint64_t size){
+    uint64_t hash = _hash64(key);
+    size_t len = strlen(key) + 1;
+    uint64_t keyOffset;
+
+    // Keep half the slots free so probes stay short
+    if ((index->nEntries + 1) * 2 > index->nSlots || (keyOffset = shm_channel_index_alloc(index, len)) == 0)
+        return -1;
+    memcpy((char*) index + keyOffset, key, len);
+
+    for (uint64_t i = hash & (index->nSlots - 1); ; i = (i + 1) & (index->nSlots - 1)){
+        if (index->slots[i].key == 0){
+            index->slots[i].hash = hash;
+            index->slots[i].key = keyOffset;
+            index->slots[i].data = data;
+            index->slots[i].size = size;
+            break;
+        }
+    }
+    index->nEntries++;
+    return 0;
+}
+
+const ShmIndexEntry_t *shm_channel_index_find(const ShmIndex_t *index, const char *key){
+    uint64_t hash = _hash64(key);
+
+    for (uint64_t i = hash & (index->nSlots - 1); index->slots[i].key != 0; i = (i + 1) & (index->nSlots - 1)){
+        if (index->slots[i].hash == hash && strcmp((const char*) index + index->slots[i].key, key) == 0)
+            return &index->slots[i];
+    }
+    return NULL;
+}
+
+uint64_t shm_channel_clock_us(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+#define HANDOFF_SPIN_MIN 64
+#define HANDOFF_SPIN_MAX 16384
+#define HANDOFF_POLL_CLOCK 1024 // Polling iterations between deadline checks
+
+static bool handoffPolling = false;
+static ShmHandoffStats_t handoffStats;
+static long nCpus = 0;
+
+static inline void _cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ volatile("yield");
+#endif
+}
+
+static bool _handoff_take(ShmHandoff_t *handoff){
+    uint32_t count = __atomic_load_n(&handoff->count, __ATOMIC_ACQUIRE);
+
+    while (count > 0){
+        if (__atomic_compare_exchange_n(&handoff->count, &count, count - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+            return true;
+    }
+    return false;
+}
+
+void shm_channel_handoff_init(ShmHandoff_t *handoff, uint32_t count){
+    handoff->count = count;
+    handoff->waiters = 0;
+    handoff->spin = HANDOFF_SPIN_MIN * 16;
+}
+
+void shm_channel_handoff_post(ShmHandoff_t *handoff){
+    __atomic_fetch_add(&handoff->count, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&handoff->waiters, __ATOMIC_SEQ_CST) > 0){
+        __atomic_fetch_add(&handoffStats.nWakes, 1, __ATOMIC_RELAXED);
+        syscall(SYS_futex, &handoff->count, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+}
+
+int shm_channel_handoff_wait(ShmHandoff_t *handoff, uint64_t deadline){
+    struct timespec at = {deadline / 1000000, deadline % 1000000 * 1000};
+    uint32_t spin = __atomic_load_n(&handoff->spin, __ATOMIC_RELAXED);
+
+    if (_handoff_take(handoff)){
+        __atomic_fetch_add(&handoffStats.nImmediate, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // Nobody can post while we spin on a single cpu
+    if (nCpus == 0)
+        nCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nCpus == 1)
+        spin = 0;
+
+    for (uint32_t i = 1; handoffPolling || i <= spin; i++){
+        _cpu_relax();
+        if (__atomic_load_n(&handoff->count, __ATOMIC_RELAXED) > 0 && _handoff_take(handoff)){
+            __atomic_fetch_add(&handoffStats.nSpun, 1, __ATOMIC_RELAXED);
+            if (!handoffPolling && spin < HANDOFF_SPIN_MAX)
+                __atomic_store_n(&handoff->spin, spin * 2, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (handoffPolling && deadline && i % HANDOFF_POLL_CLOCK == 0 && shm_channel_clock_us() >= deadline){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    if (nCpus > 1 && spin > HANDOFF_SPIN_MIN)
+        __atomic_store_n(&handoff->spin, spin / 2, __ATOMIC_RELAXED);
+
+    // Announce ourselves before the last look so a post can't miss us
+    for (;;){
+        long ret;
+
+        __atomic_fetch_add(&handoff->waiters, 1, __ATOMIC_SEQ_CST);
+        if (_handoff_take(handoff)){
+            __atomic_fetch_sub(&handoff->waiters, 1, __ATOMIC_SEQ_CST);
+            __atomic_fetch_add(&handoffStats.nSpun, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline
+        ret = syscall(SYS_futex, &handoff->count, FUTEX_WAIT_BITSET, 0, deadline ? &at : NULL, NULL, FUTEX_BITSET_MATCH_ANY);
+        __atomic_fetch_sub(&handoff->waiters, 1, __ATOMIC_SEQ_CST);
+
+        if (_handoff_take(handoff)){
+            __atomic_fetch_add(&handoffStats.nParked, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        if (ret == -1 && errno == ETIMEDOUT)
+            return -1;
+    }
+}
+
+void shm_channel_handoff_set_polling(bool isPolling){
+    handoffPolling = isPolling;
+}
+
+void shm_channel_handoff_stats(ShmHandoffStats_t *stats){
+    stats->nImmediate = __atomic_load_n(&handoffStats.nImmediate, __ATOMIC_RELAXED);
+    stats->nSpun = __atomic_load_n(&handoffStats.nSpun, __ATOMIC_RELAXED);
+    stats->nParked = __atomic_load_n(&handoffStats.nParked, __ATOMIC_RELAXED);
+    stats->nWakes = __atomic_load_n(&handoffStats.nWakes, __ATOMIC_RELAXED);
+}
+
+static void _unmap_entry(attachment_t **link){
+    attachment_t *entry = *link;
+
+    *link = entry->next;
+    if (entry->base)
+        munmap(entry->base, entry->size);
+    free(entry);
+}
+
+void *shm_channel_attach(const char *name, size_t size){
+    attachment_t **slot = &attachments[shm_channel_hash(name) % ATTACH_BUCKETS];
+    attachment_t *entry;
+    void *base = NULL;
+    int fd;
+
+    pthread_mutex_lock(&attachLock);
+    for (entry = *slot; entry; entry = entry->next){
+        if (!entry->isDetached && strcmp(entry->name, name) == 0)
+            break;
+    }
+
+    if (entry && entry->size == size){
+        entry->refs++;
+        base = entry->base;
+        goto EXIT;
+    }
+
+    // The segment was recreated with another size, drop the stale mapping once unused
+    if (entry)
+        entry->isDetached = true;
+    for (attachment_t **link = slot; *link; ){
+        if ((*link)->isDetached && (*link)->refs == 0)
+            _unmap_entry(link);
+        else
+            link = &(*link)->next;
+    }
+
+    fd = (name[0] == '/') ? open(name, O_RDWR) : shm_open(name, O_RDWR, 0600);
+    if (fd < 0){
+        fprintf(stderr, "Unable to open shared memory %s with error %s \n", name, strerror(errno));
+        goto EXIT;
+    }
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED){
+        fprintf(stderr, "mmap of %s failed with error %s \n", name, strerror(errno));
+        base = NULL;
+        goto EXIT;
+    }
+
+    entry = (attachment_t*) malloc(sizeof(attachment_t));
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    entry->base = base;
+    entry->size = size;
+    entry->refs = 1;
+    entry->isDetached = false;
+    entry->next = *slot;
+    *slot = entry;
+
+    EXIT:
+    pthread_mutex_unlock(&attachLock);
+    return base;
+}
+
+void shm_channel_release(const char *name, void *base){
+    attachment_t **link = &attachments[shm_channel_hash(name) % ATTACH_BUCKETS];
+
+    pthread_mutex_lock(&attachLock);
+    for (; *link; link = &(*link)->next){
+        if ((*link)->base == base){
+            if (--(*link)->refs == 0 && (*link)->isDetached)
+                _unmap_entry(link);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&attachLock);
+}
+
+int shm_channel_detach_prefix(const char *prefix){
+    size_t len = strlen(prefix);
+    int nDetached = 0;
+
+    pthread_mutex_lock(&attachLock);
+    for (int b = 0; b < ATTACH_BUCKETS; b++){
+        for (attachment_t **link = &attachments[b]; *link; ){
+            attachment_t *entry = *link;
+
+            if (entry->isDetached || strncmp(entry->name, prefix, len) != 0){
+                link = &entry->next;
+                continue;
+            }
+            nDetached++;
+            entry->isDetached = true;
+            if (entry->refs == 0)
+                _unmap_entry(link);
+            else
+                link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&attachLock);
+    return nDetached;
+}
+
+void shm_channel_detach_all(void){
+    pthread_mutex_lock(&attachLock);
+    for (int b = 0; b < ATTACH_BUCKETS; b++){
+        while (attachments[b])
+            _unmap_entry(&attachments[b]);
+    }
+    pthread_mutex_unlock(&attachLock);
+}
@@ -1 +1,264 @@
 /* In case you want to implement the shared memory IPC as a library... */
+#ifndef __SHM_CHANNEL_H__
+#define __SHM_CHANNEL_H__
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MAX_SHARDS 16
+#define SHARD_VNODES 64 // Points each shard owns on the hash ring
+#define MAX_NUMA_NODES 8
+
+typedef struct {
+    uint32_t hash;
+    int shard;
+}RingPoint_t;
+
+typedef struct {
+    RingPoint_t points[MAX_SHARDS * SHARD_VNODES];
+    size_t nPoints;
+}HashRing_t;
+
+/*
+ * Counting semaphore in shared memory for the chunk handoff between proxy
+ * and cache. A waiter spins on the count before it parks on a futex; the
+ * spin grows while it pays off and shrinks while it doesn't. In busy poll
+ * mode waiters never park.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t waiters;
+    uint32_t spin; // Iterations the next waiter spins for
+}ShmHandoff_t;
+
+// How waits were satisfied in this process
+typedef struct {
+    uint64_t nImmediate; // The count was up already
+    uint64_t nSpun; // It came up while spinning
+    uint64_t nParked; // The waiter slept on the futex
+    uint64_t nWakes; // Posts that had to wake a sleeper
+}ShmHandoffStats_t;
+
+/*
+ * Header of the objects simplecached publishes read-only in shared memory.
+ * The magic is set last, once the object is complete. When the cache
+ * republishes, the old object is marked retired so readers know to attach
+ * to the new one.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t retired;
+}ShmObject_t;
+
+#define FILTER_MAGIC 0x53434246u // "SCBF"
+#define FILTER_BITS_PER_KEY 10 // With 7 hashes, about 1% false positives
+#define FILTER_HASHES 7
+
+/*
+ * Bloom filter of a cache shard's keys. A key the filter rejects is
+ * certainly not cached.
+ */
+typedef struct {
+    ShmObject_t object;
+    uint64_t nBits; // Power of two
+    uint64_t nKeys;
+    uint64_t bits[];
+}ShmFilter_t;
+
+#define INDEX_MAGIC 0x53434958u // "SCIX"
+#define INDEX_ALIGN 64
+
+typedef struct {
+    uint64_t hash;
+    uint64_t key; // Offset of the NUL terminated key, 0 for a free slot
+    uint64_t data; // Offset of the body
+    uint64_t size;
+}ShmIndexEntry_t;
+
+/*
+ * Index and bodies of a cache shard's objects, so the proxy can serve hits
+ * straight from shared memory. Offsets are from the start of the index.
+ * Keys are looked up by linear probing; keys left out (bodies over the
+ * publishing budget) still go through the cache.
+ */
+typedef struct {
+    ShmObject_t object;
+    uint64_t version; // Bumped on every publish
+    uint64_t nSlots; // Power of two
+    uint64_t nEntries;
+    uint64_t size; // Bytes mapped
+    uint64_t used; // Bytes allocated so far
+    ShmIndexEntry_t slots[];
+}ShmIndex_t;
+
+/*
+ * FNV-1a hash of a NUL terminated string.
+ */
+uint32_t shm_channel_hash(const char *str);
+
+/*
+ * Writes the request message queue name of the given shard into buf.
+ * Shard 0 keeps MQ_REQUEST_NAME so a single shard setup is unchanged.
+ */
+void shm_channel_mq_name(char *buf, size_t len, int shard);
+
+/*
+ * Writes the name of segment `index` belonging to `shard` of the webproxy
+ * running in nameSpace into buf.
+ */
+void shm_channel_segment_name(char *buf, size_t len, const char *nameSpace, int shard, int index);
+
+/*
+ * Writes the prefix shared by every segment name of nameSpace into buf.
+ */
+void shm_channel_namespace_prefix(char *buf, size_t len, const char *nameSpace);
+
+/*
+ * Places nShards shards on the consistent hashing ring.
+ */
+void shm_channel_ring_init(HashRing_t *ring, int nShards);
+
+/*
+ * Returns the shard owning the given request path.
+ */
+int shm_channel_ring_lookup(const HashRing_t *ring, const char *path);
+
+/*
+ * Parses a cpu list ("0-3,8") or a NUMA node ("node:1") into set.
+ * Returns 0 on success, -1 on malformed input.
+ */
+int shm_channel_parse_cpuset(const char *spec, cpu_set_t *set);
+
+/*
+ * Returns the number of NUMA nodes (at least 1, at most MAX_NUMA_NODES).
+ */
+int shm_channel_numa_nodes(void);
+
+/*
+ * Returns the NUMA node owning the given cpu, 0 if unknown.
+ */
+int shm_channel_cpu_node(int cpu);
+
+/*
+ * Returns the cpu at position `index` (modulo its size) of set.
+ */
+int shm_channel_cpuset_nth(const cpu_set_t *set, int index);
+
+/*
+ * Binds the pages of [addr, addr + len) to the given NUMA node. Must be
+ * called before the pages are first touched. Returns 0 on success.
+ */
+int shm_channel_bind_node(void *addr, size_t len, int node);
+
+/*
+ * Returns the default huge page size in bytes (2 MB if unknown).
+ */
+size_t shm_channel_hugepage_size(void);
+
+/*
+ * Writes the name of the negative lookup filter of `shard` into buf.
+ */
+void shm_channel_filter_name(char *buf, size_t len, int shard);
+
+/*
+ * Returns the size in bytes of a filter sized for nKeys keys.
+ */
+size_t shm_channel_filter_size(size_t nKeys);
+
+/*
+ * Clears a filter of shm_channel_filter_size(nKeys) bytes. The magic is left
+ * at 0, the publisher sets it to FILTER_MAGIC once every key is added.
+ */
+void shm_channel_filter_init(ShmFilter_t *filter, size_t nKeys);
+
+void shm_channel_filter_add(ShmFilter_t *filter, const char *key);
+
+/*
+ * Returns false if key was never added, true if it may have been.
+ */
+bool shm_channel_filter_contains(const ShmFilter_t *filter, const char *key);
+
+/*
+ * Writes the name of the shared index of `shard` into buf.
+ */
+void shm_channel_index_name(char *buf, size_t len, int shard);
+
+/*
+ * Returns the size in bytes of an index of nKeys keys holding dataLen bytes
+ * of keys and bodies (each rounded up to INDEX_ALIGN).
+ */
+size_t shm_channel_index_size(size_t nKeys, size_t dataLen);
+
+/*
+ * Clears an index of `size` bytes sized for nKeys keys. The magic is left
+ * at 0 like for filters.
+ */
+void shm_channel_index_init(ShmIndex_t *index, size_t nKeys, size_t size, uint64_t version);
+
+/*
+ * Reserves len bytes in the index. Returns their offset, or 0 if full.
+ */
+uint64_t shm_channel_index_alloc(ShmIndex_t *index, size_t len);
+
+/*
+ * Adds key with the body at offset data. Returns 0, or -1 if full.
+ */
+int shm_channel_index_insert(ShmIndex_t *index, const char *key, uint64_t data, uint64_t size);
+
+/*
+ * Returns the entry of key, or NULL if the index doesn't hold it.
+ */
+const ShmIndexEntry_t *shm_channel_index_find(const ShmIndex_t *index, const char *key);
+
+/*
+ * Returns CLOCK_MONOTONIC in microseconds.
+ */
+uint64_t shm_channel_clock_us(void);
+
+/*
+ * Initializes a handoff with `count` posts available.
+ */
+void shm_channel_handoff_init(ShmHandoff_t *handoff, uint32_t count);
+
+void shm_channel_handoff_post(ShmHandoff_t *handoff);
+
+/*
+ * Takes a post, waiting until deadline (shm_channel_clock_us(), 0 waits
+ * forever). Returns 0, or -1 with errno set to ETIMEDOUT.
+ */
+int shm_channel_handoff_wait(ShmHandoff_t *handoff, uint64_t deadline);
+
+/*
+ * Makes every wait of this process spin until it is satisfied instead of
+ * parking. Meant for waiters that own a dedicated core.
+ */
+void shm_channel_handoff_set_polling(bool isPolling);
+
+void shm_channel_handoff_stats(ShmHandoffStats_t *stats);
+
+/*
+ * Maps `size` bytes of the named shared memory for reading and writing,
+ * pre-faulting the page tables. Names starting with '/' are file paths
+ * (hugetlbfs files, /proc/<pid>/fd/<n> for memfd regions), anything else
+ * is a POSIX shm name. Mappings are cached, so attaching to the same name
+ * again returns the same address. Every successful attach needs a
+ * shm_channel_release. Returns NULL on failure.
+ */
+void *shm_channel_attach(const char *name, size_t size);
+
+void shm_channel_release(const char *name, void *base);
+
+/*
+ * Forgets the mappings whose names start with prefix, unmapping each one
+ * once nobody uses it. Returns how many there were.
+ */
+int shm_channel_detach_prefix(const char *prefix);
+
+/*
+ * Unmaps every mapping made by shm_channel_attach.
+ */
+void shm_channel_detach_all(void);
+
+#endif // __SHM_CHANNEL_H__
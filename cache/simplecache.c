@@ -13,6 +13,7 @@
 
 #include "gfserver.h"
 #include "cache-student.h"
+#include "simplecache.h"
 
 #define MAX_KEYLEN 1024
 
@@ -20,25 +21,202 @@
 #define CACHE_FAILURE (-1)
 #endif // CACHE_FAILURE
 
+#define HASH_CHUNK 65536
+#define SAMPLE_LEN 4096 /* Bytes fingerprinted at the start, middle and end of a file */
+#define DEFAULT_MAX_OPEN 256
+
+#define SNAPSHOT_MAGIC "SCSNAP\0"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_BODIES 0x1
+#define SNAPSHOT_ALIGN 4096
+
+/*
+ * The index is laid out the same way in memory and in a snapshot: keys and
+ * paths live in one string pool and records refer to them by offset, so a
+ * snapshot is used in place once mapped.
+ */
+
+/* A body is one distinct content, shared by every key whose file holds the same bytes */
 typedef struct{
-	int fildes;
-	char key[MAX_KEYLEN];
+	uint64_t size;
+	uint64_t hash;      /* of the sampled bytes, only set while deduplicating */
+	uint64_t data;      /* offset of the bytes in the snapshot, 0 if they live in the file */
+	uint64_t path;      /* string pool offset of the file holding the bytes */
+	uint64_t refs;      /* keys sharing the body */
+} body_t;
+
+typedef struct{
+	uint64_t key;       /* string pool offset */
+	uint64_t body;
+	uint64_t path;      /* string pool offset of the key's own file */
+	int64_t mtime;      /* of that file when it was indexed, in nanoseconds */
 } item_t;
 
+typedef struct{
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t manifestSize;   /* the manifest the snapshot was built from */
+	int64_t manifestMtime;
+	uint64_t nitems;
+	uint64_t nbodies;
+	uint64_t nstrings;
+	uint64_t itemsOffset;
+	uint64_t bodiesOffset;
+	uint64_t stringsOffset;
+	uint64_t fileSize;
+} snapshot_t;
+
 static int nitems;
 static item_t *items;
+static int nbodies;
+static body_t *bodies;
+static char *strings;
+static size_t nstrings;
+
+/* An open body file. Entries no transfer has pinned sit on the LRU list and are
+   closed once more than maxOpen files are open */
+typedef struct fdentry_t{
+	int body;
+	int fildes;
+	int pins;
+	struct fdentry_t *prev;
+	struct fdentry_t *next;
+} fdentry_t;
+
+static fdentry_t **opened;    /* per body, NULL while its file is closed */
+static fdentry_t lru = {.prev = &lru, .next = &lru}; /* lru.next is the most recently used */
+static int nopen;
+static int maxOpen = DEFAULT_MAX_OPEN;
+static pthread_mutex_t fdLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set when the index is mapped from a snapshot */
+static void *snapshotMap;
+static size_t snapshotLen;
+static int snapshotFd = -1;
+static int isEmbedded;        /* bodies are read from the snapshot itself */
+
+static int64_t _mtime_ns(const struct stat *statbuf){
+	return statbuf->st_mtim.tv_sec * 1000000000LL + statbuf->st_mtim.tv_nsec;
+}
 
 static int _itemcmp(const void *a, const void *b){
-	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
+	return strcmp(strings + ((item_t*) a)->key, strings + ((item_t*) b)->key);
 }
 
 unsigned long int cache_delay = 0;
 
+static uint64_t _intern_string(const char *str, size_t *capacity){
+	size_t len = strlen(str) + 1;
+	uint64_t offset = nstrings;
+
+	while(nstrings + len > *capacity){
+		*capacity *= 2;
+		strings = realloc(strings, *capacity);
+	}
+	memcpy(strings + nstrings, str, len);
+	nstrings += len;
+	return offset;
+}
+
+/* FNV-1a over a few samples of the file, enough to tell most files of equal size apart
+   without reading them whole */
+static uint64_t _sample_file(int fildes, uint64_t size){
+	unsigned char buf[SAMPLE_LEN];
+	uint64_t hash = 14695981039346656037ULL;
+	uint64_t at[3] = {0, size / 2, size > SAMPLE_LEN ? size - SAMPLE_LEN : 0};
+	ssize_t len;
+
+	for(int s = 0; s < 3; s++){
+		if((len = pread(fildes, buf, sizeof(buf), at[s])) <= 0)
+			break;
+		for(ssize_t i = 0; i < len; i++){
+			hash ^= buf[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+static int _same_content(int a, int b, size_t size){
+	unsigned char bufa[HASH_CHUNK], bufb[HASH_CHUNK];
+	off_t offset = 0;
+
+	while(offset < size){
+		ssize_t len = pread(a, bufa, sizeof(bufa), offset);
+		if(len <= 0 || pread(b, bufb, len, offset) != len || memcmp(bufa, bufb, len) != 0)
+			return 0;
+		offset += len;
+	}
+	return 1;
+}
+
+/* Opens the file of a body, refusing it if it no longer matches the index */
+static int _open_body(int b){
+	struct stat statbuf;
+	int fildes;
+
+	if((fildes = open(strings + bodies[b].path, O_RDONLY)) < 0){
+		fprintf(stderr, "Unable to open file %s.\n", strings + bodies[b].path);
+		return -1;
+	}
+	if(fstat(fildes, &statbuf) != 0 || (uint64_t) statbuf.st_size != bodies[b].size){
+		fprintf(stderr, "File %s changed size since it was indexed.\n", strings + bodies[b].path);
+		close(fildes);
+		return -1;
+	}
+	return fildes;
+}
+
+static int _pendingcmp(const void *a, const void *b){
+	uint64_t sa = ((body_t*) a)->size, sb = ((body_t*) b)->size;
+	return (sa > sb) - (sa < sb);
+}
+
+/* Only files of equal size can hold the same bytes. Those whose samples match too are
+   compared in full, and merged if identical */
+static void _dedup_group(body_t *group, int n, int *owner){
+	int first = nbodies;
+
+	for(int i = 0; i < n; i++){
+		int fildes = -1, b;
+
+		body_t *body = &bodies[nbodies];
+		*body = group[i];
+		body->hash = 0;
+		if(n > 1 && (fildes = open(strings + body->path, O_RDONLY)) >= 0)
+			body->hash = _sample_file(fildes, body->size);
+
+		for(b = first; fildes >= 0 && b < nbodies; b++){
+			int other;
+			if(bodies[b].hash != body->hash || (other = open(strings + bodies[b].path, O_RDONLY)) < 0)
+				continue;
+			int same = _same_content(other, fildes, body->size);
+			close(other);
+			if(same)
+				break;
+		}
+		if(fildes >= 0)
+			close(fildes);
+
+		if(fildes < 0 || b == nbodies){
+			b = nbodies++;
+			bodies[b].refs = 0;
+		}
+		bodies[b].refs++;
+		owner[group[i].refs] = b; // refs holds the item index while pending
+	}
+}
 
 int simplecache_init(char *filename){
 	FILE *filelist;
 	int capacity = 16;
-	char *path, *ptr;
+	size_t poolCapacity = 4096;
+	char line[MAX_KEYLEN];
+	char *key, *path, *ptr;
+	struct stat statbuf;
+	body_t *pending;
+	int *owner;
 
 	if( NULL == (filelist = fopen(filename, "r"))){
 		fprintf(stderr, "Unable to open file in simplecache_init.\n");
@@ -46,63 +224,416 @@ int simplecache_init(char *filename){
 	}
 
 	items = (item_t*) malloc(capacity * sizeof(item_t));
+	pending = (body_t*) malloc(capacity * sizeof(body_t));
 	nitems = 0;
-	while(fgets(items[nitems].key, MAX_KEYLEN, filelist)){
+	nbodies = 0;
+	strings = (char*) malloc(poolCapacity);
+	nstrings = 0;
+
+	// Only stat the files here, they are opened when first requested
+	while(fgets(line, MAX_KEYLEN, filelist)){
 		/*Taking out EOL character*/
-		items[nitems].key[strlen(items[nitems].key)-1] = '\0';
+		line[strcspn(line, "\n")] = '\0';
 
 		/* Using space delimiter to sep key and path*/
-		ptr = items[nitems].key;
-		strsep(&ptr, " \t"); 		/* The key is first */
+		ptr = line;
+		key = strsep(&ptr, " \t"); 		/* The key is first */
 		path = strsep(&ptr, " \t"); /* The path second */
+		if(path == NULL)
+			continue;
 
-		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
-			fprintf(stderr, "Unable to open file %s.\n", path);
-			exit(CACHE_FAILURE);
+		if( 0 > stat(path, &statbuf)){
+			fprintf(stderr, "Unable to stat file %s, leaving %s out.\n", path, key);
+			continue;
 		}
+		items[nitems].key = _intern_string(key, &poolCapacity);
+		items[nitems].path = _intern_string(path, &poolCapacity);
+		items[nitems].mtime = _mtime_ns(&statbuf);
+		pending[nitems].size = (uint64_t) statbuf.st_size;
+		pending[nitems].path = items[nitems].path;
+		pending[nitems].data = 0;
+		pending[nitems].refs = nitems;
 		nitems++;
 
 		if(nitems == capacity){
 			capacity *= 2;
 			items = realloc(items, capacity * sizeof(item_t));
+			pending = realloc(pending, capacity * sizeof(body_t));
 		}
 
 	}
 
 	fclose(filelist);
 
+	bodies = (body_t*) malloc((nitems > 0 ? nitems : 1) * sizeof(body_t));
+	owner = (int*) malloc((nitems > 0 ? nitems : 1) * sizeof(int));
+	qsort(pending, nitems, sizeof(body_t), _pendingcmp);
+	for(int i = 0, j; i < nitems; i = j){
+		for(j = i + 1; j < nitems && pending[j].size == pending[i].size; j++)
+			;
+		_dedup_group(&pending[i], j - i, owner);
+	}
+	for(int i = 0; i < nitems; i++)
+		items[i].body = owner[i];
+	free(owner);
+	free(pending);
+
+	opened = (fdentry_t**) calloc(nbodies > 0 ? nbodies : 1, sizeof(fdentry_t*));
+	fprintf(stdout, "simplecache holds %d keys over %d distinct bodies\n", nitems, nbodies);
+
 	qsort(items, nitems, sizeof(item_t), _itemcmp);
 
 	return EXIT_SUCCESS;
 }
 
-int simplecache_get(char *key){
+/* Maps the snapshot and checks it was taken from the manifest and files as they are now */
+static int _load_snapshot(char *filename, char *snapshot){
+	struct stat manifest, statbuf;
+	snapshot_t *header;
+	int fildes;
+
+	if(stat(filename, &manifest) != 0 || (fildes = open(snapshot, O_RDONLY)) < 0)
+		return -1;
+	if(fstat(fildes, &statbuf) != 0 || statbuf.st_size < sizeof(snapshot_t))
+		goto INVALID;
+
+	snapshotLen = statbuf.st_size;
+	snapshotMap = mmap(NULL, snapshotLen, PROT_READ, MAP_SHARED | MAP_POPULATE, fildes, 0);
+	if(snapshotMap == MAP_FAILED){
+		snapshotMap = NULL;
+		goto INVALID;
+	}
+
+	header = (snapshot_t*) snapshotMap;
+	if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+	   header->version != SNAPSHOT_VERSION ||
+	   header->fileSize != snapshotLen ||
+	   header->manifestSize != manifest.st_size ||
+	   header->manifestMtime != _mtime_ns(&manifest) ||
+	   header->itemsOffset + header->nitems * sizeof(item_t) > snapshotLen ||
+	   header->bodiesOffset + header->nbodies * sizeof(body_t) > snapshotLen ||
+	   header->stringsOffset + header->nstrings > snapshotLen ||
+	   (header->nstrings > 0 && ((char*) snapshotMap)[header->stringsOffset + header->nstrings - 1] != '\0'))
+		goto INVALID;
+
+	nitems = header->nitems;
+	nbodies = header->nbodies;
+	nstrings = header->nstrings;
+	items = (item_t*) ((char*) snapshotMap + header->itemsOffset);
+	bodies = (body_t*) ((char*) snapshotMap + header->bodiesOffset);
+	strings = (char*) snapshotMap + header->stringsOffset;
+
+	for(int i = 0; i < nitems; i++){
+		if(items[i].key >= nstrings || items[i].body >= nbodies || items[i].path >= nstrings)
+			goto INVALID;
+	}
+	for(int b = 0; b < nbodies; b++){
+		if(bodies[b].path >= nstrings || ((header->flags & SNAPSHOT_BODIES) && bodies[b].data + bodies[b].size > snapshotLen))
+			goto INVALID;
+	}
+
+	// The manifest only lists paths, a file edited in place shows in its size or mtime
+	for(int i = 0; i < nitems; i++){
+		struct stat file;
+		if(stat(strings + items[i].path, &file) != 0 || (uint64_t) file.st_size != bodies[items[i].body].size ||
+		   _mtime_ns(&file) != items[i].mtime){
+			fprintf(stderr, "File %s changed since the snapshot was taken.\n", strings + items[i].path);
+			goto INVALID;
+		}
+	}
+
+	opened = (fdentry_t**) calloc(nbodies > 0 ? nbodies : 1, sizeof(fdentry_t*));
+	isEmbedded = (header->flags & SNAPSHOT_BODIES) != 0;
+	snapshotFd = fildes;
+
+	fprintf(stdout, "simplecache mapped %d keys over %d distinct bodies from %s\n", nitems, nbodies, snapshot);
+	return 0;
+
+	INVALID:
+	fprintf(stderr, "Snapshot %s is stale or damaged, rebuilding it.\n", snapshot);
+	if(snapshotMap)
+		munmap(snapshotMap, snapshotLen);
+	snapshotMap = NULL;
+	close(fildes);
+	return -1;
+}
+
+static int _write_all(int fildes, const void *buf, size_t len, off_t offset){
+	while(len > 0){
+		ssize_t written = pwrite(fildes, buf, len, offset);
+		if(written <= 0)
+			return -1;
+		buf = (const char*) buf + written;
+		len -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+/* Writes the index (and the bodies if asked) next to the snapshot, then renames it in place */
+static int _save_snapshot(char *filename, char *snapshot, int withBodies){
+	char tmpname[PATH_MAX];
+	unsigned char buf[HASH_CHUNK];
+	struct stat manifest;
+	snapshot_t header;
+	uint64_t dataOffset;
+	int fildes;
+
+	if(stat(filename, &manifest) != 0)
+		return -1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.flags = withBodies ? SNAPSHOT_BODIES : 0;
+	header.manifestSize = manifest.st_size;
+	header.manifestMtime = _mtime_ns(&manifest);
+	header.nitems = nitems;
+	header.nbodies = nbodies;
+	header.nstrings = nstrings;
+	header.itemsOffset = sizeof(snapshot_t);
+	header.bodiesOffset = header.itemsOffset + nitems * sizeof(item_t);
+	header.stringsOffset = header.bodiesOffset + nbodies * sizeof(body_t);
+	header.fileSize = header.stringsOffset + nstrings;
+
+	// Bodies follow the index, each starting on its own page
+	if(withBodies){
+		dataOffset = header.fileSize;
+		for(int b = 0; b < nbodies; b++){
+			dataOffset = (dataOffset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+			bodies[b].data = dataOffset;
+			dataOffset += bodies[b].size;
+		}
+		header.fileSize = dataOffset;
+	}
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", snapshot);
+	if((fildes = open(tmpname, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0){
+		fprintf(stderr, "Unable to create snapshot %s.\n", tmpname);
+		return -1;
+	}
+
+	if(_write_all(fildes, &header, sizeof(header), 0) != 0 ||
+	   _write_all(fildes, items, nitems * sizeof(item_t), header.itemsOffset) != 0 ||
+	   _write_all(fildes, bodies, nbodies * sizeof(body_t), header.bodiesOffset) != 0 ||
+	   _write_all(fildes, strings, nstrings, header.stringsOffset) != 0)
+		goto FAILED;
+
+	for(int b = 0; withBodies && b < nbodies; b++){
+		int body = _open_body(b);
+		if(body < 0)
+			goto FAILED;
+		for(uint64_t done = 0; done < bodies[b].size; ){
+			ssize_t len = pread(body, buf, sizeof(buf), done);
+			if(len <= 0 || _write_all(fildes, buf, len, bodies[b].data + done) != 0){
+				close(body);
+				goto FAILED;
+			}
+			done += len;
+		}
+		close(body);
+	}
+
+	if(ftruncate(fildes, header.fileSize) != 0 || fsync(fildes) != 0 || rename(tmpname, snapshot) != 0)
+		goto FAILED;
+	close(fildes);
+
+	// This process keeps reading the bodies from their own files
+	for(int b = 0; b < nbodies; b++)
+		bodies[b].data = 0;
+
+	fprintf(stdout, "simplecache wrote snapshot %s (%lu bytes)\n", snapshot, (unsigned long) header.fileSize);
+	return 0;
+
+	FAILED:
+	fprintf(stderr, "Unable to write snapshot %s: %s\n", snapshot, strerror(errno));
+	for(int b = 0; b < nbodies; b++)
+		bodies[b].data = 0;
+	close(fildes);
+	unlink(tmpname);
+	return -1;
+}
+
+int simplecache_init_snapshot(char *filename, char *snapshot, int withBodies){
+	if(_load_snapshot(filename, snapshot) == 0)
+		return EXIT_SUCCESS;
+
+	simplecache_init(filename);
+	_save_snapshot(filename, snapshot, withBodies);
+	return EXIT_SUCCESS;
+}
+
+static item_t *_find(char *key){
 	int lo = 0;
 	int hi = nitems - 1;
 	int mid, cmp;
 
-	if (cache_delay > 0) {
-		usleep(cache_delay);
-	}
-
 	while (lo <= hi) {
 		// Key is in items[lo..hi] or not present.
 		mid = lo + (hi - lo) / 2;
-		cmp = strcmp(key,items[mid].key);
+		cmp = strcmp(key, strings + items[mid].key);
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
-			return items[mid].fildes;
-		}
+		else return &items[mid];
 	}
-	return -1;
+	return NULL;
+}
+
+static void _lru_unlink(fdentry_t *entry){
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+}
+
+static void _lru_push(fdentry_t *entry){
+	entry->prev = &lru;
+	entry->next = lru.next;
+	lru.next->prev = entry;
+	lru.next = entry;
+}
+
+/* Closes the least recently used files nobody has pinned, down to maxOpen. Called with fdLock held */
+static void _evict(){
+	while(nopen > maxOpen && lru.prev != &lru){
+		fdentry_t *entry = lru.prev;
+		_lru_unlink(entry);
+		opened[entry->body] = NULL;
+		close(entry->fildes);
+		free(entry);
+		nopen--;
+	}
+}
+
+/* Returns the open file of a body, opening it on first use, and pins it until simplecache_unpin */
+static int _pin_body(int b){
+	fdentry_t *entry;
+	int fildes;
+
+	pthread_mutex_lock(&fdLock);
+	if((entry = opened[b]) != NULL){
+		if(entry->pins++ == 0)
+			_lru_unlink(entry);
+		pthread_mutex_unlock(&fdLock);
+		return entry->fildes;
+	}
+	pthread_mutex_unlock(&fdLock);
+
+	// Open outside the lock, somebody else may beat us to it
+	if((fildes = _open_body(b)) < 0)
+		return -1;
+
+	pthread_mutex_lock(&fdLock);
+	if((entry = opened[b]) != NULL){
+		if(entry->pins++ == 0)
+			_lru_unlink(entry);
+		pthread_mutex_unlock(&fdLock);
+		close(fildes);
+		return entry->fildes;
+	}
+	entry = (fdentry_t*) malloc(sizeof(fdentry_t));
+	entry->body = b;
+	entry->fildes = fildes;
+	entry->pins = 1;
+	opened[b] = entry;
+	nopen++;
+	_evict();
+	pthread_mutex_unlock(&fdLock);
+
+	return fildes;
+}
+
+void simplecache_unpin(char *key){
+	item_t *item;
+	fdentry_t *entry;
+
+	if(isEmbedded || (item = _find(key)) == NULL)
+		return;
+
+	pthread_mutex_lock(&fdLock);
+	if((entry = opened[item->body]) != NULL && entry->pins > 0 && --entry->pins == 0){
+		_lru_push(entry);
+		_evict();
+	}
+	pthread_mutex_unlock(&fdLock);
+}
+
+void simplecache_set_max_open(int n){
+	pthread_mutex_lock(&fdLock);
+	maxOpen = (n > 0) ? n : DEFAULT_MAX_OPEN;
+	_evict();
+	pthread_mutex_unlock(&fdLock);
+}
+
+int simplecache_get_extent(char *key, off_t *base, size_t *size){
+	item_t *item;
+	int fildes;
+
+	if (cache_delay > 0) {
+		usleep(cache_delay);
+	}
+
+	if ((item = _find(key)) == NULL)
+		return -1;
+
+	fildes = isEmbedded ? snapshotFd : _pin_body(item->body);
+	if (fildes < 0)
+		return -1;
+
+	*base = bodies[item->body].data;
+	*size = bodies[item->body].size;
+	return fildes;
+}
+
+int simplecache_get(char *key){
+	off_t base;
+	size_t size;
+	int fildes;
+
+	if ((fildes = simplecache_get_extent(key, &base, &size)) < 0)
+		return -1;
+
+	lseek(fildes, base, SEEK_SET);
+	return fildes;
+}
+
+ssize_t simplecache_size(char *key){
+	item_t *item = _find(key);
+
+	return item ? (ssize_t) bodies[item->body].size : -1;
+}
+
+int simplecache_body_id(char *key){
+	item_t *item = _find(key);
+
+	return item ? (int) item->body : -1;
+}
+
+int simplecache_keys(void (*visit)(const char *key, void *arg), void *arg){
+	for(int i = 0; visit && i < nitems; i++)
+		visit(strings + items[i].key, arg);
+	return nitems;
 }
 
 void simplecache_destroy(){
-	int i;
-	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
+	pthread_mutex_lock(&fdLock);
+	for(int b = 0; b < nbodies; b++){
+		if(opened[b]){
+			close(opened[b]->fildes);
+			free(opened[b]);
+		}
+	}
+	free(opened);
+	opened = NULL;
+	nopen = 0;
+	lru.prev = lru.next = &lru;
+	pthread_mutex_unlock(&fdLock);
 
-	free(items);
+	if(snapshotMap){
+		munmap(snapshotMap, snapshotLen);
+		close(snapshotFd);
+	}
+	else {
+		free(items);
+		free(bodies);
+		free(strings);
+	}
 }
@@ -1,21 +1,77 @@
 #ifndef _SIMPLECACHE_H_
 #define _SIMPLECACHE_H_
 
+#include <sys/types.h>
+
 /* 
  * Initializes the input cache given the information from
  * the provided file.  Each row of the file is assumed
  * to contain a key and a file path separated by a space.
  * Subsequent calls to simplecache_get with a key value
  * as an argument will return the file descriptor for the 
- * given file path.
+ * given file path. Files are only stat'ed here and opened on
+ * first use; a file that is missing leaves its key out. Files
+ * of equal size are told apart by a sample of their bytes, only
+ * the ones whose samples match are read in full, and keys with
+ * byte-identical content share one stored body.
  */
 int simplecache_init(char *filename);
 
+/*
+ * Like simplecache_init, starting from the snapshot file instead when it
+ * was taken from the manifest, and the files it lists, as they are now
+ * (same sizes and mtimes). The snapshot holds the index, and the object
+ * bodies too if withBodies was set when it was written; it is mapped and
+ * used in place, so a restart costs no parsing, opening or sorting. A
+ * missing, stale or damaged snapshot is rebuilt from the manifest.
+ */
+int simplecache_init_snapshot(char *filename, char *snapshot, int withBodies);
+
 /* 
  * Returns the file descriptor associated with the input key.
+ * Keys whose files hold identical bytes share a single descriptor.
+ * The descriptor stays open at least until the matching
+ * simplecache_unpin, every successful get needs one.
  */
 int simplecache_get(char *key);
 
+/*
+ * Like simplecache_get, also returning the offset of the object within the
+ * descriptor and its size. Objects whose bodies live in a snapshot share
+ * the snapshot's descriptor, so readers must pread from base.
+ */
+int simplecache_get_extent(char *key, off_t *base, size_t *size);
+
+/*
+ * Releases a descriptor returned by simplecache_get(_extent). Once no
+ * transfer uses it, it may be closed to stay within the open file limit.
+ */
+void simplecache_unpin(char *key);
+
+/*
+ * Sets how many files may stay open while unused (Default is 256).
+ * The least recently used one is closed first.
+ */
+void simplecache_set_max_open(int n);
+
+/*
+ * Returns the size in bytes of the object associated with the input key,
+ * or -1 if the key is not cached. Unlike simplecache_get this does not
+ * apply the configured cache delay, so schedulers can use it cheaply.
+ */
+ssize_t simplecache_size(char *key);
+
+/*
+ * Returns a number below the key count identifying the body of key, the
+ * same for keys sharing a body, or -1 if the key is not cached.
+ */
+int simplecache_body_id(char *key);
+
+/*
+ * Calls visit on every cached key. Returns the number of keys.
+ */
+int simplecache_keys(void (*visit)(const char *key, void *arg), void *arg);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
@@ -15,6 +15,8 @@
 #include "cache-student.h"
 #include "shm_channel.h"
 #include "simplecache.h"
+#include "workpool.h"
+#include "slab.h"
 
 #if !defined(CACHE_FAILURE)
 #define CACHE_FAILURE (-1)
@@ -22,27 +24,354 @@
 
 #define MAX_CACHE_REQUEST_LEN 82021
 
-bool quitProcess = false;
+volatile sig_atomic_t quitProcess = 0; // The signal that stopped us, the main loop cleans up
 MSQRequest_t *g_request;
 
+#define CACHE_QUEUE_LEN 256 // Per worker
+#define RECEIVE_BATCH 8
+#define GROW_WAIT_MS 5 // A queue that hasn't moved this long gets another worker
+#define STOP_CHECK_MS 1000 // Longest a blocking receive goes without looking at quitProcess
+#define STOP_JOIN_MS 1000 // Longest shutdown waits for a worker still serving a request
+
+// Every worker owns a deque in cache_pool, requests go to workers of the segment's node
+static workpool_t cache_pool;
+static int nNodes = 1;
+static bool isPinned = false;
+static cpu_set_t workerCpus;
+
+// Requests up to smallSize bytes (and misses) take the express lane, nReserved workers serve only it
+static size_t smallSize = 16384;
+static int nReserved = -1;
+
+// Request messages, received into by the main loop and given back by whichever worker served them
+static slab_t requestSlab;
+
+// Workers beyond -t are started as the queue backs up, up to maxThreads, and retire after idleMs
+static threadInfo_t *threadsInfo;
+static int maxThreads = 0;
+static unsigned idleMs = 10000;
+static pthread_attr_t workerAttr;
+
+// Objects published read-only for the proxy, mapped read/write only here
+typedef struct {
+    char name[MAX_SHMNAME_LEN];
+    ShmObject_t *object;
+    size_t size;
+}Published_t;
+
+static Published_t g_filter, g_index;
+
+// The request queue is shared by every webproxy registered with us, the last one out removes it
+static char g_mqName[MAX_SHMNAME_LEN];
+static int nProxies = 0;
+static size_t indexBudget = 0; // Bytes of bodies published in the index, 0 publishes none
+
+static void _retire(Published_t *pub){
+    if (pub->object){
+        __atomic_store_n(&pub->object->retired, 1, __ATOMIC_RELEASE);
+        munmap(pub->object, pub->size);
+        pub->object = NULL;
+    }
+}
+
+// Only flags the stop: the slab and pool locks may be held by the thread it interrupted
 static void _sig_handler(int signo){
-    if (signo == SIGINT || signo == SIGTERM){
-        /* Unlink IPC mechanisms here*/
-        quitProcess = true;
-        if (g_request) free(g_request);
-        exit(signo);
+    if (signo == SIGINT || signo == SIGTERM)
+        quitProcess = signo;
+}
+
+// Called by the main thread once its loop has seen quitProcess
+static void _shutdown(void){
+    /* Unlink IPC mechanisms here*/
+    ShmHandoffStats_t stats;
+    slab_stats_t slabStats;
+    struct timespec until;
+    bool isJoined = true;
+
+    shm_channel_handoff_stats(&stats);
+    fprintf(stdout, "Proxy handoffs: %lu immediate, %lu after spinning, %lu parked, %lu wakeups \n",
+            (unsigned long) stats.nImmediate, (unsigned long) stats.nSpun,
+            (unsigned long) stats.nParked, (unsigned long) stats.nWakes);
+    _retire(&g_filter);
+    shm_unlink(g_filter.name);
+    _retire(&g_index);
+    shm_unlink(g_index.name);
+    if (nProxies == 0)
+        mq_unlink(g_mqName);
+
+    // A worker may be waiting on a proxy that is gone, give those up rather than hang
+    for (int i=0; i < maxThreads; i++)
+        threadsInfo[i].isEnabled = false; //signal all thread to close
+    workpool_close(&cache_pool);
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += STOP_JOIN_MS / 1000;
+    for (int i=0; i < maxThreads; i++){
+        if (threadsInfo[i].isStarted && pthread_timedjoin_np(threadsInfo[i].pthread, NULL, &until) != 0)
+            isJoined = false;
+    }
+    fprintf(stdout, "Cache workers stole work %zu times \n", cache_pool.nsteals);
+
+    // The receive buffer and requests still queued or being served are in use too
+    slab_stats(&requestSlab, &slabStats);
+    fprintf(stdout, "Request slab: %zu slabs, %zu allocated, %zu freed, %zu in use, %zu depot trips \n",
+            slabStats.nslabs, slabStats.nallocs, slabStats.nfrees, slabStats.inuse, slabStats.ntrips);
+
+    if (isJoined){
+        workpool_destroy(&cache_pool);
+        slab_destroy(&requestSlab);
+        shm_channel_detach_all();
     }
+    pthread_attr_destroy(&workerAttr);
+    exit(quitProcess);
 }
 
 unsigned long int cache_delay;
 
+/*
+ * Creates a fresh object of `size` bytes under pub->name and maps it. What was
+ * published under that name before, by us or a previous run, is mapped into
+ * old so it can be retired once the new object is complete: readers see
+ * either a complete old object or a complete new one.
+ */
+static void *_publish_begin(Published_t *pub, size_t size, Published_t *old){
+    struct stat st;
+    void *object;
+    int fd;
+
+    *old = *pub;
+    pub->object = NULL;
+    if (old->object == NULL && (fd = shm_open(pub->name, O_RDWR, 0)) >= 0){
+        if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ShmObject_t)){
+            old->object = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            old->size = st.st_size;
+            if (old->object == MAP_FAILED)
+                old->object = NULL;
+        }
+        close(fd);
+    }
+    shm_unlink(pub->name);
+
+    if ((fd = shm_open(pub->name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 || ftruncate(fd, size) != 0){
+        fprintf(stderr, "Unable to create %s, lookups go to the cache \n", pub->name);
+        if (fd >= 0)
+            close(fd);
+        _retire(old);
+        return NULL;
+    }
+    object = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (object == MAP_FAILED){
+        shm_unlink(pub->name);
+        _retire(old);
+        return NULL;
+    }
+    return object;
+}
+
+// Sets the magic last, a reader that sees it sees the whole object
+static void _publish_end(Published_t *pub, void *object, size_t size, uint32_t magic, Published_t *old){
+    pub->object = (ShmObject_t*) object;
+    pub->size = size;
+    __atomic_store_n(&pub->object->magic, magic, __ATOMIC_RELEASE);
+    _retire(old);
+}
+
+static void _filter_key(const char *key, void *arg){
+    shm_channel_filter_add((ShmFilter_t*) arg, key);
+}
+
+// Publishes a filter of the cached keys, the proxy answers the keys it rejects itself
+static void _publish_filter(int shard){
+    size_t nKeys = simplecache_keys(NULL, NULL);
+    size_t size = shm_channel_filter_size(nKeys);
+    ShmFilter_t *filter;
+    Published_t old;
+
+    shm_channel_filter_name(g_filter.name, sizeof(g_filter.name), shard);
+    if ((filter = _publish_begin(&g_filter, size, &old)) == NULL)
+        return;
+    shm_channel_filter_init(filter, nKeys);
+    simplecache_keys(_filter_key, filter);
+    _publish_end(&g_filter, filter, size, FILTER_MAGIC, &old);
+    fprintf(stdout, "Published filter %s of %zu keys \n", g_filter.name, nKeys);
+}
+
+typedef struct {
+    char **keys;
+    size_t nKeys;
+}KeyList_t;
+
+static void _list_key(const char *key, void *arg){
+    KeyList_t *list = (KeyList_t*) arg;
+    list->keys[list->nKeys++] = (char*) key;
+}
+
+// Copies the body of key to `data`, returns 0 once all of it is there
+static int _copy_body(char *key, char *data, size_t size){
+    off_t base;
+    size_t fileLen, done = 0;
+    int fildes;
+
+    if ((fildes = simplecache_get_extent(key, &base, &fileLen)) < 0)
+        return -1;
+    while (done < size){
+        ssize_t readLen = pread(fildes, data + done, size - done, base + done);
+        if (readLen <= 0)
+            break;
+        done += readLen;
+    }
+    simplecache_unpin(key);
+    return done == size ? 0 : -1;
+}
+
+// Retires an index a previous run may have left, the proxy must not serve from it
+static void _withdraw_index(int shard){
+    struct stat st;
+    int fd;
+
+    shm_channel_index_name(g_index.name, sizeof(g_index.name), shard);
+    if ((fd = shm_open(g_index.name, O_RDWR, 0)) < 0)
+        return;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ShmObject_t)){
+        g_index.object = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        g_index.size = st.st_size;
+        if (g_index.object == MAP_FAILED)
+            g_index.object = NULL;
+        _retire(&g_index);
+    }
+    close(fd);
+    shm_unlink(g_index.name);
+}
+
+// Tracks the webproxies using this cache. One that left may come back with the same segment
+// names, so its mappings are dropped, each once the requests still using it are done
+static void _control(MSQRequest_t *control){
+    if (control->kind == MSQ_REGISTER){
+        nProxies++;
+        fprintf(stdout, "Webproxy %s registered, %d attached \n", control->filePath, nProxies);
+    }
+    else if (control->kind == MSQ_UNREGISTER){
+        int nDetached = shm_channel_detach_prefix(control->filePath);
+        if (control->shmName[0])
+            nDetached += shm_channel_detach_prefix(control->shmName);
+        if (nProxies > 0)
+            nProxies--;
+        fprintf(stdout, "Webproxy %s left, dropped %d mappings, %d attached \n", control->filePath, nDetached, nProxies);
+    }
+}
+
+/*
+ * Publishes the index with the bodies, up to indexBudget bytes of them, so
+ * the proxy serves those hits without a request. Keys sharing a body share
+ * its copy; bodies past the budget are left out and served as usual.
+ */
+static void _publish_index(int shard){
+    KeyList_t list = {NULL, 0};
+    size_t nKeys = simplecache_keys(NULL, NULL);
+    size_t dataLen = 0, bodyLen = 0, size;
+    uint64_t *bodyData, version = 1;
+    ShmIndex_t *index;
+    Published_t old;
+
+    list.keys = (char**) malloc(nKeys * sizeof(char*));
+    bodyData = (uint64_t*) calloc(nKeys, sizeof(uint64_t));
+    simplecache_keys(_list_key, &list);
+
+    // Size it: every key, and each distinct body while the budget lasts
+    for (size_t i = 0; i < nKeys; i++){
+        int body = simplecache_body_id(list.keys[i]);
+        size_t len = simplecache_size(list.keys[i]);
+
+        dataLen += (strlen(list.keys[i]) + INDEX_ALIGN) / INDEX_ALIGN * INDEX_ALIGN;
+        if (bodyData[body] == 0 && bodyLen + len <= indexBudget){
+            bodyData[body] = 1;
+            bodyLen += (len + INDEX_ALIGN - 1) / INDEX_ALIGN * INDEX_ALIGN;
+        }
+    }
+    size = shm_channel_index_size(nKeys, dataLen + bodyLen);
+
+    shm_channel_index_name(g_index.name, sizeof(g_index.name), shard);
+    if ((index = _publish_begin(&g_index, size, &old)) != NULL){
+        if (old.object && old.size >= sizeof(ShmIndex_t) && old.object->magic == INDEX_MAGIC)
+            version = ((ShmIndex_t*) old.object)->version + 1;
+        shm_channel_index_init(index, nKeys, size, version);
+
+        for (size_t i = 0; i < nKeys; i++){
+            int body = simplecache_body_id(list.keys[i]);
+            size_t len = simplecache_size(list.keys[i]);
+
+            if (bodyData[body] == 1){
+                // Empty bodies still need a distinct, valid offset
+                bodyData[body] = shm_channel_index_alloc(index, len ? len : 1);
+                if (bodyData[body] == 0 || _copy_body(list.keys[i], (char*) index + bodyData[body], len) != 0){
+                    fprintf(stderr, "Unable to publish %s \n", list.keys[i]);
+                    bodyData[body] = 0;
+                }
+            }
+            if (bodyData[body] != 0)
+                shm_channel_index_insert(index, list.keys[i], bodyData[body], len);
+        }
+        _publish_end(&g_index, index, size, INDEX_MAGIC, &old);
+        fprintf(stdout, "Published index %s version %lu, %lu of %zu keys in %zu bytes \n", g_index.name,
+                (unsigned long) version, (unsigned long) index->nEntries, nKeys, size);
+    }
+
+    free(bodyData);
+    free(list.keys);
+}
+
+static void _start_worker(int index){
+    threadInfo_t *worker = &threadsInfo[index];
+
+    sigset_t stops, old;
+
+    // The slot's previous thread retired, it is gone or about to be
+    if (worker->isStarted)
+        pthread_join(worker->pthread, NULL);
+    worker->isEnabled = true;
+
+    // Stops go to the main thread, whose receive they interrupt
+    sigemptyset(&stops);
+    sigaddset(&stops, SIGINT);
+    sigaddset(&stops, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stops, &old);
+    worker->isStarted = pthread_create(&worker->pthread, &workerAttr, cache_worker, worker) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!worker->isStarted)
+        fprintf(stderr, "Error creating thread");
+}
+
+// Starts another worker if the queue backs up, called by the main loop after each batch
+static void _grow(void){
+    int index = workpool_wants_worker(&cache_pool, GROW_WAIT_MS);
+
+    if (index < 0)
+        return;
+    workpool_activate(&cache_pool, index);
+    _start_worker(index);
+    fprintf(stdout, "Started cache worker %d, %zu requests queued \n", index, workpool_pending(&cache_pool));
+}
+
 #define USAGE                                                                 \
 "usage:\n"                                                                    \
 "  simplecached [options]\n"                                                  \
 "options:\n"                                                                  \
 "  -c [cachedir]       Path to static files (Default: ./)\n"                  \
 "  -t [thread_count]   Thread count for work queue (Default is 42, Range is 1-235711)\n"      \
+"  -M [max_threads]    Start workers up to this many as requests back up (Default is thread_count)\n" \
+"  -I [ms]             Workers beyond thread_count retire after idling this long (Default is 10000)\n" \
+"  -k [kbytes]         Stack size of each worker (Default is the system's)\n"                  \
 "  -d [delay]          Delay in simplecache_get (Default is 0, Range is 0-2500000 (microseconds)\n "	\
+"  -s [shard]          Shard index this cache serves (Default is 0, Range is 0-15)\n"              \
+"  -a [cpus]           Pin the cache to a cpu list (e.g. 0-3,8) or NUMA node (node:1)\n"          \
+"  -w [cpus]           Pin cache workers round robin to a cpu list, serving their node first\n"    \
+"  -S [bytes]          Objects up to this size are scheduled first (Default is 16384)\n"         \
+"  -r [workers]        Workers reserved for small objects (Default is 1, 0 with one thread)\n"   \
+"  -p [snapshot]       Start from this index snapshot, writing it if missing or stale\n"         \
+"  -b                  Keep the object bodies in the snapshot too\n"                          \
+"  -o [files]          Most cached files kept open while unused (Default is 256)\n"           \
+"  -B                  Busy poll for the proxy instead of sleeping (needs dedicated cores)\n" \
+"  -e [mbytes]         Publish bodies up to this total in shared memory, served by the proxy (Default is 0)\n" \
 "  -h                  Show this help message\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -52,6 +381,19 @@ static struct option gLongOptions[] = {
         {"nthreads",           required_argument,      NULL,           't'},
         {"hidden",			 no_argument,			 NULL,			 'i'}, /* server side */
         {"delay", 			 required_argument,		 NULL, 			 'd'}, // delay.
+        {"shard",              required_argument,      NULL,           's'},
+        {"affinity",           required_argument,      NULL,           'a'},
+        {"worker-cpus",        required_argument,      NULL,           'w'},
+        {"small-size",         required_argument,      NULL,           'S'},
+        {"reserved",           required_argument,      NULL,           'r'},
+        {"snapshot",           required_argument,      NULL,           'p'},
+        {"snapshot-bodies",    no_argument,            NULL,           'b'},
+        {"max-open",           required_argument,      NULL,           'o'},
+        {"export",             required_argument,      NULL,           'e'},
+        {"busy-poll",          no_argument,            NULL,           'B'},
+        {"max-threads",        required_argument,      NULL,           'M'},
+        {"idle-timeout",       required_argument,      NULL,           'I'},
+        {"stack-size",         required_argument,      NULL,           'k'},
         {NULL,                 0,                      NULL,             0}
 };
 
@@ -62,12 +404,18 @@ void Usage() {
 int main(int argc, char **argv) {
     int nthreads = 7;
     char *cachedir = "locals.txt";
+    char *affinity = NULL;
+    char *workerList = NULL;
+    char *snapshot = NULL;
+    bool isSnapshotBodies = false;
+    int shard = 0;
+    long stackKb = 0;
     char option_char;
 
     /* disable buffering to stdout */
     setbuf(stdout, NULL);
 
-    while ((option_char = getopt_long(argc, argv, "id:c:hlxt:", gLongOptions, NULL)) != -1) {
+    while ((option_char = getopt_long(argc, argv, "id:c:hlxt:s:a:w:S:r:p:bo:e:BM:I:k:", gLongOptions, NULL)) != -1) {
         switch (option_char) {
             default:
                 Usage();
@@ -85,6 +433,45 @@ int main(int argc, char **argv) {
             case 'd':
                 cache_delay = (unsigned long int) atoi(optarg);
                 break;
+            case 's': // shard index
+                shard = atoi(optarg);
+                break;
+            case 'a': // cpu affinity
+                affinity = optarg;
+                break;
+            case 'w': // worker cpus
+                workerList = optarg;
+                break;
+            case 'S': // small object threshold
+                smallSize = (size_t) atol(optarg);
+                break;
+            case 'r': // reserved small object workers
+                nReserved = atoi(optarg);
+                break;
+            case 'p': // snapshot
+                snapshot = optarg;
+                break;
+            case 'b': // snapshot bodies
+                isSnapshotBodies = true;
+                break;
+            case 'o': // max open files
+                simplecache_set_max_open(atoi(optarg));
+                break;
+            case 'B': // busy poll
+                shm_channel_handoff_set_polling(true);
+                break;
+            case 'e': // bodies published for the proxy
+                indexBudget = (size_t) atol(optarg) * 1024 * 1024;
+                break;
+            case 'M': // max threads
+                maxThreads = atoi(optarg);
+                break;
+            case 'I': // idle timeout
+                idleMs = (unsigned) atol(optarg);
+                break;
+            case 'k': // stack size
+                stackKb = atol(optarg);
+                break;
             case 'i': // server side usage
             case 'u': // experimental
             case 'j': // experimental
@@ -102,28 +489,94 @@ int main(int argc, char **argv) {
         exit(__LINE__);
     }
 
-    if (SIG_ERR == signal(SIGTERM, _sig_handler)){
+    if (maxThreads == 0)
+        maxThreads = nthreads;
+
+    if ((maxThreads < nthreads) || (maxThreads > 235711)) {
+        fprintf(stderr, "Invalid max threads must be in between thread_count-235711\n");
+        exit(__LINE__);
+    }
+
+    if ((stackKb != 0) && (stackKb < (long) PTHREAD_STACK_MIN / 1024)) {
+        fprintf(stderr, "Stack size must be at least %ld kbytes\n", (long) PTHREAD_STACK_MIN / 1024);
+        exit(__LINE__);
+    }
+
+    if (nReserved < 0)
+        nReserved = (nthreads > 1) ? 1 : 0;
+
+    if (nReserved >= nthreads) {
+        fprintf(stderr, "Reserved workers must leave at least one general worker\n");
+        exit(__LINE__);
+    }
+
+    if ((shard < 0) || (shard >= MAX_SHARDS)) {
+        fprintf(stderr, "Invalid shard index must be in between 0-%d\n", MAX_SHARDS - 1);
+        exit(__LINE__);
+    }
+
+    if (affinity){
+        // Worker threads inherit the mask, so the whole shard stays on these cpus
+        cpu_set_t cpus;
+        if (shm_channel_parse_cpuset(affinity, &cpus) != 0){
+            fprintf(stderr, "Invalid cpu list %s\n", affinity);
+            exit(__LINE__);
+        }
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0){
+            fprintf(stderr, "sched_setaffinity failed with error %s \n", strerror(errno));
+            exit(CACHE_FAILURE);
+        }
+    }
+
+    if (workerList){
+        if (shm_channel_parse_cpuset(workerList, &workerCpus) != 0){
+            fprintf(stderr, "Invalid worker cpu list %s\n", workerList);
+            exit(__LINE__);
+        }
+        isPinned = true;
+        nNodes = shm_channel_numa_nodes();
+    }
+
+    // No SA_RESTART, a stop has to interrupt mq_receive for the main loop to see it
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = _sig_handler;
+    sigemptyset(&stop.sa_mask);
+
+    if (sigaction(SIGTERM, &stop, NULL) != 0){
         fprintf(stderr,"Unable to catch SIGTERM...exiting.\n");
         exit(CACHE_FAILURE);
     }
 
-    if (SIG_ERR == signal(SIGINT, _sig_handler)){
+    if (sigaction(SIGINT, &stop, NULL) != 0){
         fprintf(stderr,"Unable to catch SIGINT...exiting.\n");
         exit(CACHE_FAILURE);
     }
 
     // Initialize cache
-    simplecache_init(cachedir);
+    if (snapshot)
+        simplecache_init_snapshot(cachedir, snapshot, isSnapshotBodies);
+    else
+        simplecache_init(cachedir);
+    _publish_filter(shard);
+    if (indexBudget > 0)
+        _publish_index(shard);
+    else
+        _withdraw_index(shard);
 
     // Cache code goes here
-    threadInfo_t threadsInfo[nthreads];
-
-    cache_queue = (steque_t*) malloc(sizeof(steque_t));
-    steque_init(cache_queue);
+    threadsInfo = (threadInfo_t*) calloc(maxThreads, sizeof(threadInfo_t));
+    pthread_attr_init(&workerAttr);
+    if (stackKb > 0 && pthread_attr_setstacksize(&workerAttr, (size_t) stackKb * 1024) != 0){
+        fprintf(stderr, "Invalid stack size %ld kbytes\n", stackKb);
+        exit(__LINE__);
+    }
 
-    cache_lock  = (lock_t*) malloc(sizeof(lock_t));
-    pthread_cond_init(&cache_lock->cond, NULL);
-    pthread_mutex_init(&cache_lock->mutex, NULL);
+    // Every worker that may ever run gets its deque now, the ones beyond nthreads start inactive
+    workpool_init(&cache_pool, maxThreads, CACHE_QUEUE_LEN);
+    if (maxThreads > nthreads)
+        workpool_set_elastic(&cache_pool, nthreads, idleMs);
+    slab_init(&requestSlab, MAX_MSG_SIZE);
 
     // Open message request queue (with R/W locks) again and post the request
     struct mq_attr attr;
@@ -132,135 +585,319 @@ int main(int argc, char **argv) {
     attr.mq_msgsize = MAX_MSG_SIZE;
     attr.mq_curmsgs = 0;
 
-    for(int i=0; i <= nthreads; i++){
-        threadsInfo[i].isEnabled = true;
-        if (pthread_create(&threadsInfo[i].pthread, NULL, cache_worker, &threadsInfo[i])){
-            fprintf(stderr, "Error creating thread");
-        }
+    for(int i=0; i < maxThreads; i++){
+        threadsInfo[i].index = i;
+        threadsInfo[i].node = isPinned ? shm_channel_cpu_node(shm_channel_cpuset_nth(&workerCpus, i)) % nNodes : 0;
+        workpool_set_node(&cache_pool, i, threadsInfo[i].node);
+        if (i < nReserved)
+            workpool_reserve(&cache_pool, i);
+        if (i < nthreads)
+            _start_worker(i);
     }
 
-    // OPEN Message Request Queue (passing locks) again and read the request
-    mqd_t mqRequest;
-    while((mqRequest = mq_open(MQ_REQUEST_NAME, O_RDWR, 0666, &attr)) < 0){
-        fprintf(stdout, "keep waiting for message queue %s \n", MQ_REQUEST_NAME);
+    // Open the request queue, creating it if no webproxy did yet
+    shm_channel_mq_name(g_mqName, sizeof(g_mqName), shard);
+
+    mqd_t mqRequest = -1;
+    while(!quitProcess && (mqRequest = mq_open(g_mqName, O_RDWR | O_CREAT, 0666, &attr)) < 0){
+        fprintf(stdout, "keep waiting for message queue %s \n", g_mqName);
         sleep(1);
     }
 
+    MSQRequest_t *batch[RECEIVE_BATCH];
+    MSQRequest_t *nodeBatch[RECEIVE_BATCH];
+    struct timespec noWait = {0, 0};
+
     while(!quitProcess){
-        //read MQ_REQUEST and enqueue
-        g_request = (MSQRequest_t *) malloc(MAX_MSG_SIZE);
-        if (mq_receive(mqRequest, (char *)g_request, MAX_MSG_SIZE, 0) == -1){
-            fprintf(stdout, "Warning: keep waiting on mq_receive. \n");
-            continue;
+        //read MQ_REQUEST, blocking for the first one and then draining what is already queued
+        int nReceived = 0;
+        while(nReceived < RECEIVE_BATCH){
+            // A buffer that received nothing, or a control message, is kept for the next receive
+            if (g_request == NULL)
+                g_request = (MSQRequest_t *) slab_alloc(&requestSlab);
+            ssize_t received;
+            if (nReceived > 0)
+                received = mq_timedreceive(mqRequest, (char *)g_request, MAX_MSG_SIZE, 0, &noWait);
+            else {
+                // Something is queued, come back in time to see whether it moves. Otherwise wake
+                // now and then anyway, in case a stop landed just before the receive
+                bool isGrowing = maxThreads > nthreads && workpool_pending(&cache_pool) > 0;
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += (isGrowing ? GROW_WAIT_MS : STOP_CHECK_MS) * 1000000L;
+                while (until.tv_nsec >= 1000000000){
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+                received = mq_timedreceive(mqRequest, (char *)g_request, MAX_MSG_SIZE, 0, &until);
+            }
+            if (received == -1){
+                if (nReceived == 0 && errno != ETIMEDOUT && errno != EINTR)
+                    fprintf(stdout, "Warning: keep waiting on mq_receive. \n");
+                break;
+            }
+            if (g_request->kind != MSQ_FILE){
+                _control(g_request);
+                continue;
+            }
+            batch[nReceived++] = g_request;
+            g_request = NULL;
         }
 
-        if (cache_queue){
-            pthread_mutex_lock(&cache_lock->mutex);
-            steque_enqueue(cache_queue, g_request);
-            pthread_mutex_unlock(&cache_lock->mutex);
+        // Small objects and misses skip the line, the rest is handed out node by node
+        for(int i = 0; i < nReceived; i++){
+            ssize_t size = simplecache_size(batch[i]->filePath);
+            gfrange_t range = {.offset = batch[i]->offset, .length = batch[i]->length};
+            if (size < 0 || gfrange_span(&range, size) <= smallSize){
+                workpool_submit_express(&cache_pool, batch[i]);
+                batch[i] = NULL;
+            }
         }
 
-        if (pthread_cond_signal(&cache_lock->cond) != 0)
-            fprintf(stderr, "Broadcast Failed with Error %s \n", strerror(errno));
-    }
+        for(int n = 0; n < nNodes; n++){
+            int nNode = 0;
+            for(int i = 0; i < nReceived; i++){
+                if (batch[i] && batch[i]->node % nNodes == n)
+                    nodeBatch[nNode++] = batch[i];
+            }
+            if (nNode > 0)
+                workpool_submit(&cache_pool, (workpool_item*) nodeBatch, nNode, n);
+        }
 
-    pthread_mutex_destroy(&cache_lock->mutex);
-    pthread_cond_destroy(&cache_lock->cond);
+        if (maxThreads > nthreads)
+            _grow();
+    }
 
     // Clean up
-    if (cache_queue) steque_destroy(cache_queue);
-    if (cache_lock) free(cache_lock);
-
-    for (int i=0; i <= nthreads; i++){
-        threadsInfo[i].isEnabled = false; //signal all thread to close
-        if (pthread_cond_broadcast(&cache_lock->cond) != 0)
-            fprintf(stderr, "error broadcasting with error %s \n", strerror(errno));
-        pthread_join(threadsInfo[i].pthread, NULL);
-    }
+    _shutdown();
 
     // Won't execute
     return 0;
 }
 
+// Pins a worker to its cpu
+static void _place_worker(int index){
+    cpu_set_t cpus;
+    int cpu = shm_channel_cpuset_nth(&workerCpus, index);
+
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+        fprintf(stderr, "Failed to pin cache worker %d to cpu %d \n", index, cpu);
+}
+
+// A segment of a request as seen by the worker filling it
+typedef struct {
+    ContextShm_t *shm;
+    char *data; // Payload, the control block follows it
+    const char *name; // Mapping holding the segment
+    char *region;
+    bool isOwned;
+    bool isStarted;
+}StripeFill_t;
+
+static ContextShm_t *_stripe_segment(MSQRequest_t *fileReq, int stripe, StripeFill_t *fill){
+    size_t offset = stripe ? fileReq->stripes[stripe - 1].shmOffset : fileReq->shmOffset;
+
+    fill->name = stripe ? fileReq->stripes[stripe - 1].shmName : fileReq->shmName;
+    if (offset + SHM_SEGMENT_LEN(fileReq->segmentSize) > fileReq->regionSize)
+        return NULL;
+    fill->region = (char*) shm_channel_attach(fill->name, fileReq->regionSize);
+    fill->data = fill->region ? fill->region + offset : NULL;
+    fill->shm = fill->region ? (ContextShm_t*) (fill->data + SHM_CONTROL_OFFSET(fileReq->segmentSize)) : NULL;
+    return fill->shm;
+}
+
+static void _release_stripes(StripeFill_t *fills, int nStripes){
+    for(int j = 0; j < nStripes; j++){
+        if (fills[j].region)
+            shm_channel_release(fills[j].name, fills[j].region);
+    }
+}
+
+// The first worker to claim a stripe fills all of its chunks. The ticket keeps a helper
+// that shows up after its request is over off the segment's next request
+static bool _claim_stripe(ContextShm_t *shmMapped, uint64_t ticket){
+    return __atomic_compare_exchange_n(&shmMapped->stripeTicket, &ticket, ticket + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Waits for the proxy to hand the segment back, writing the status and length on the first turn.
+// Returns false once the proxy gave up on the request
+static bool _stripe_turn(StripeFill_t *fill, MSQRequest_t *fileReq, gfstatus_t status, size_t fileLen){
+    shm_channel_handoff_wait(&fill->shm->semWRITE, 0);
+    if (__atomic_load_n(&fill->shm->abandoned, __ATOMIC_ACQUIRE) == fileReq->ticket)
+        return false;
+    if (!fill->isStarted){
+        fill->shm->status = status;
+        fill->shm->fileLen = fileLen;
+        fill->isStarted = true;
+    }
+    return true;
+}
+
+static bool _stripe_chunk(StripeFill_t *fill, MSQRequest_t *fileReq, int fileDesc, off_t fileBase, size_t fileLen, size_t k){
+    size_t chunkSize = fileReq->segmentSize;
+    size_t chunk = chunkSize;
+    ssize_t readLen;
+
+    if (chunk > fileLen - k * chunkSize)
+        chunk = fileLen - k * chunkSize;
+
+    if (!_stripe_turn(fill, fileReq, GF_OK, fileLen))
+        return false;
+    readLen = pread(fileDesc, fill->data, chunk, fileBase + fileReq->offset + k * chunkSize);
+    fill->shm->dataLen = (readLen < 0) ? 0 : readLen;
+    shm_channel_handoff_post(&fill->shm->semREAD);
+    return true;
+}
+
+// Asks other workers to fill the stripes of a large request in parallel. Only the worker
+// serving the request itself may ask: a helper waits on the proxy, which drains the stripes
+// in order, so it must never run ahead of the request's own worker.
+// Whoever gets to a stripe first fills it, so a helper that shows up late is a no-op
+static void _submit_helpers(MSQRequest_t *fileReq){
+    ssize_t size = simplecache_size(fileReq->filePath);
+    gfrange_t range = {.offset = fileReq->offset, .length = fileReq->length};
+    size_t chunkSize = fileReq->segmentSize;
+    size_t nChunks = (size < 0) ? 0 : (gfrange_span(&range, size) + chunkSize - 1) / chunkSize;
+
+    for(int j = 1; j < fileReq->nStripes && j < nChunks; j++){
+        MSQRequest_t *helper = (MSQRequest_t *) slab_alloc(&requestSlab);
+        memcpy(helper, fileReq, sizeof(MSQRequest_t));
+        helper->stripe = j;
+        workpool_submit(&cache_pool, (workpool_item*) &helper, 1, helper->node % nNodes);
+    }
+}
+
 void *cache_worker(void* arg){
-    struct stat fileStat;
+    off_t fileBase;
+    size_t fileSize;
     bool isFileExist = false;
 
     MSQRequest_t *fileReq = NULL;
-    ContextShm_t* shmMapped = NULL;
-    size_t readLen = 0;
-    size_t fileRead = 0;
-    void* shmDataAddr;
+    StripeFill_t fills[MAX_STRIPES];
+    gfstatus_t status;
+    size_t fileLen, nChunks, chunkSize;
     int fileDesc = -1;
+    int nStripes, first;
+    bool isAbandoned, isAttached;
 
     threadInfo_t *threadInfo = (threadInfo_t*) arg;
 
+    if (isPinned)
+        _place_worker(threadInfo->index);
+
     //This needs to be called from handler
     while(threadInfo->isEnabled){
         //Read the request from queue
-        pthread_mutex_lock(&cache_lock->mutex);
-        while(steque_isempty(cache_queue))
-            pthread_cond_wait(&cache_lock->cond, &cache_lock->mutex);
-        fileReq = (MSQRequest_t*) steque_pop(cache_queue);
-        pthread_mutex_unlock(&cache_lock->mutex);
+        if (threadInfo->index < nReserved)
+            fileReq = (MSQRequest_t*) workpool_take_express(&cache_pool);
+        else
+            fileReq = (MSQRequest_t*) workpool_take(&cache_pool, threadInfo->index);
 
+        // Closed, or idle long enough to retire
         if (fileReq == NULL){
-            fprintf(stderr, "keep waiting to read request queue\n");
+            if (threadInfo->isEnabled)
+                fprintf(stdout, "Cache worker %d retired after idling \n", threadInfo->index);
+            break;
+        }
+
+        // A helper fills one stripe only, the request itself fills every stripe nobody helps with
+        nStripes = (fileReq->nStripes < 1) ? 1 : fileReq->nStripes;
+        first = (fileReq->stripe > 0) ? fileReq->stripe : 0;
+        bzero(fills, sizeof(fills));
+        isAttached = true;
+        for(int j = first; j < nStripes; j++){
+            if (_stripe_segment(fileReq, j, &fills[j]) == NULL)
+                isAttached = false;
+            if (first > 0)
+                break;
+        }
+        if (fills[first].shm == NULL){
+            fprintf(stderr, "simplecached mmap failed \n");
+            _release_stripes(fills, nStripes);
+            slab_free(&requestSlab, fileReq);
             continue;
         }
+        // Helpers never ask for stripe 0, so the request itself only misses its claim when it
+        // comes from a webproxy that has gone and its segments belong to somebody else now
+        if (!_claim_stripe(fills[first].shm, fileReq->ticket)){
+            if (first == 0)
+                fprintf(stderr, "Dropping stale request for %s \n", fileReq->filePath);
+            _release_stripes(fills, nStripes);
+            slab_free(&requestSlab, fileReq);
+            continue;
+        }
+        fills[first].isOwned = true;
+
+        // Chunks can't go out in order without every stripe. Fail the request on stripe 0 alone
+        // and leave the other stripes unclaimed, the proxy takes those back itself
+        if (!isAttached){
+            fprintf(stderr, "Unable to map every stripe of %s \n", fileReq->filePath);
+            _release_stripes(fills + 1, nStripes - 1);
+            nStripes = 1;
+        }
+        else if (first == 0)
+            _submit_helpers(fileReq);
 
         // Check if cache exist
-        fprintf(stdout, "Requested file path %s \n", fileReq->filePath);
+        fprintf(stdout, "Requested file path %s stripe %d/%d \n", fileReq->filePath, first, nStripes);
         isFileExist = false;
-        if ((fileDesc = simplecache_get(fileReq->filePath)) != -1){
-            if((fcntl(fileDesc, F_GETFD) != -1 || errno != EBADF) && fstat(fileDesc, &fileStat) != -1){
+        if (isAttached && (fileDesc = simplecache_get_extent(fileReq->filePath, &fileBase, &fileSize)) != -1){
+            if(fcntl(fileDesc, F_GETFD) != -1 || errno != EBADF){
                 isFileExist = true;
             }
         }
 
-        // Now share the file contents since proxy is ready to receive
-        int shmFD = shm_open(fileReq->shmName, O_RDWR, 0600);
-        shmMapped = (ContextShm_t*) mmap(NULL, fileReq->segmentSize,PROT_READ | PROT_WRITE, MAP_SHARED, shmFD, 0);
-        if(shmMapped == MAP_FAILED){
-            fprintf(stderr, "simplecached mmap failed \n");
+        status = isFileExist ? GF_OK : (isAttached ? GF_FILE_NOT_FOUND : GF_ERROR);
+        fileLen = 0;
+        if (isFileExist){
+            gfrange_t range = {.offset = fileReq->offset, .length = fileReq->length};
+            fileLen = gfrange_span(&range, fileSize);
         }
-
-        // lock the semaphore for write
-        sem_wait(&shmMapped->semWRITE);
-        
-        if (!isFileExist){
-            strcpy(shmMapped->filePath, fileReq->filePath);
-            shmMapped->fileLen = 0;
-            shmMapped->status = GF_FILE_NOT_FOUND;
-            fprintf(stdout, "GF_FILE_NOT_FOUND for path %s \n ", fileReq->filePath);
+        chunkSize = fileReq->segmentSize;
+        nChunks = (fileLen + chunkSize - 1) / chunkSize;
+
+        // Chunk k goes through stripe k % nStripes, the proxy drains them in order
+        isAbandoned = false;
+        for(size_t k = first; k < nChunks && !isAbandoned; k += (first > 0) ? nStripes : 1){
+            StripeFill_t *fill = &fills[k % nStripes];
+            if (k < nStripes && k > 0 && first == 0)
+                fill->isOwned = (fill->shm != NULL) && _claim_stripe(fill->shm, fileReq->ticket);
+            if (fill->isOwned)
+                isAbandoned = !_stripe_chunk(fill, fileReq, fileDesc, fileBase, fileLen, k);
         }
-        else { //FILE EXIST
-            shmDataAddr = shmMapped +1 ;
-            strcpy(shmMapped->filePath, fileReq->filePath);
-            shmMapped->status = GF_OK;
-            shmMapped->fileLen = fileStat.st_size;
-
-            fileRead = 0; // Start with zero
-            while(fileRead < shmMapped->fileLen){
-                readLen = pread(fileDesc, (char*)shmDataAddr, fileReq->segmentSize - sizeof(ContextShm_t), fileRead);
-                shmMapped->dataLen = readLen;
-                fileRead += readLen;
-
-                sem_post(&shmMapped->semREAD);
-                sem_wait(&shmMapped->semWRITE);
 
-            }
-            fprintf(stdout, "File Read %zu of file %s \n", fileRead, shmMapped->filePath);
+        // unlock the semaphore to the reader of every stripe we filled. An abandoned request
+        // takes over the stripes nobody claimed yet, so that every one of them gets finished
+        for(int j = first; j < nStripes; j++){
+            if (first == 0 && j > 0 && !fills[j].isOwned && (j >= nChunks || isAbandoned))
+                fills[j].isOwned = (fills[j].shm != NULL) && _claim_stripe(fills[j].shm, fileReq->ticket);
+            if (!fills[j].isOwned)
+                continue;
+            if (!isAbandoned && _stripe_turn(&fills[j], fileReq, status, fileLen))
+                shm_channel_handoff_post(&fills[j].shm->semREAD);
+            else
+                isAbandoned = true;
+            // Our last touch of the segment, the proxy may reclaim it from here on
+            __atomic_store_n(&fills[j].shm->finished, fileReq->ticket, __ATOMIC_RELEASE);
         }
+        if (isAbandoned)
+            fprintf(stdout, "Proxy gave up on %s \n", fileReq->filePath);
 
-        // unlock the semaphore to the reader
-        sem_post(&shmMapped->semREAD);
+        if (isFileExist){
+            simplecache_unpin(fileReq->filePath);
+            fprintf(stdout, "File Read %zu of file %s \n", fileLen, fileReq->filePath);
+        }
+        else if (isAttached)
+            fprintf(stdout, "GF_FILE_NOT_FOUND for path %s \n ", fileReq->filePath);
 
         // Release MQ Request Memmory
-        if (fileReq) free(fileReq);
+        _release_stripes(fills, nStripes);
+        slab_free(&requestSlab, fileReq);
 
     }
 
     return (void*) NULL;
 
-}
\ No newline at end of file
+}
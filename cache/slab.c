@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "slab.h"
+
+#if !defined(SLAB_FAILURE)
+#define SLAB_FAILURE (-1)
+#endif // SLAB_FAILURE
+
+#define SLAB_ALIGN 64
+#define SLAB_BYTES (64 * 1024) // Carved per trip to malloc, at least one magazine of objects
+
+static void* _allocate(size_t size){
+  void* mem = calloc(1, size);
+
+  if(mem == NULL){
+    fprintf(stderr, "Error: unable to allocate %zu bytes for a slab pool.\n", size);
+    fflush(stderr);
+    exit(SLAB_FAILURE);
+  }
+  return mem;
+}
+
+/* Takes an empty magazine from the depot, or makes one. Called with the lock held */
+static slab_magazine_t* _empty_magazine(slab_t* this){
+  slab_magazine_t* mag = this->empty;
+
+  if(mag == NULL)
+    return (slab_magazine_t*) _allocate(sizeof(slab_magazine_t));
+  this->empty = mag->next;
+  return mag;
+}
+
+static void _deposit(slab_t* this, slab_magazine_t* mag){
+  slab_magazine_t** list = (mag->count > 0) ? &this->full : &this->empty;
+
+  mag->next = *list;
+  *list = mag;
+}
+
+/* Carves a new slab into full magazines for the depot. Called with the lock held */
+static void _grow(slab_t* this){
+  void* slab;
+  char* obj;
+
+  if(posix_memalign(&slab, SLAB_ALIGN, SLAB_ALIGN + this->perslab * this->objsize) != 0){
+    fprintf(stderr, "Error: unable to allocate a slab of %zu objects.\n", this->perslab);
+    fflush(stderr);
+    exit(SLAB_FAILURE);
+  }
+  *(void**) slab = this->slabs;
+  this->slabs = slab;
+  this->nslabs++;
+
+  obj = (char*) slab + SLAB_ALIGN;
+  for(size_t i = 0; i < this->perslab; i += SLAB_MAGAZINE){
+    slab_magazine_t* mag = _empty_magazine(this);
+
+    for(mag->count = 0; mag->count < SLAB_MAGAZINE; mag->count++, obj += this->objsize)
+      mag->objs[mag->count] = obj;
+    _deposit(this, mag);
+  }
+}
+
+/* Hands the magazines of an exiting thread back to the depot */
+static void _retire_cache(void* arg){
+  slab_cache_t* cache = (slab_cache_t*) arg;
+  slab_t* this = cache->pool;
+  slab_cache_t** link;
+
+  pthread_mutex_lock(&this->lock);
+  _deposit(this, cache->loaded);
+  _deposit(this, cache->previous);
+  this->nallocs += cache->nallocs;
+  this->nfrees += cache->nfrees;
+  for(link = &this->caches; *link != cache; link = &(*link)->next)
+    ;
+  *link = cache->next;
+  pthread_mutex_unlock(&this->lock);
+
+  free(cache);
+}
+
+static slab_cache_t* _cache(slab_t* this){
+  slab_cache_t* cache = (slab_cache_t*) pthread_getspecific(this->key);
+
+  if(cache != NULL)
+    return cache;
+
+  cache = (slab_cache_t*) _allocate(sizeof(slab_cache_t));
+  cache->pool = this;
+  pthread_mutex_lock(&this->lock);
+  cache->loaded = _empty_magazine(this);
+  cache->previous = _empty_magazine(this);
+  cache->next = this->caches;
+  this->caches = cache;
+  pthread_mutex_unlock(&this->lock);
+
+  pthread_setspecific(this->key, cache);
+  return cache;
+}
+
+void slab_init(slab_t* this, size_t objsize){
+  memset(this, 0, sizeof(slab_t));
+  pthread_mutex_init(&this->lock, NULL);
+  pthread_key_create(&this->key, _retire_cache);
+
+  /* Objects start on their own cache line, so threads holding neighbours don't share one */
+  this->objsize = (objsize + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+  this->perslab = SLAB_BYTES / this->objsize / SLAB_MAGAZINE * SLAB_MAGAZINE;
+  if(this->perslab == 0)
+    this->perslab = SLAB_MAGAZINE;
+}
+
+void* slab_alloc(slab_t* this){
+  slab_cache_t* cache = _cache(this);
+  slab_magazine_t* mag = cache->loaded;
+
+  if(mag->count == 0){
+    if(cache->previous->count > 0){
+      cache->loaded = cache->previous;
+      cache->previous = mag;
+    }
+    else{
+      pthread_mutex_lock(&this->lock);
+      if(this->full == NULL)
+        _grow(this);
+      _deposit(this, cache->previous);
+      cache->previous = mag;
+      cache->loaded = this->full;
+      this->full = this->full->next;
+      this->ntrips++;
+      pthread_mutex_unlock(&this->lock);
+    }
+    mag = cache->loaded;
+  }
+
+  __atomic_store_n(&cache->nallocs, cache->nallocs + 1, __ATOMIC_RELAXED);
+  return mag->objs[--mag->count];
+}
+
+void slab_free(slab_t* this, void* obj){
+  slab_cache_t* cache = _cache(this);
+  slab_magazine_t* mag = cache->loaded;
+
+  if(mag->count == SLAB_MAGAZINE){
+    if(cache->previous->count == 0){
+      cache->loaded = cache->previous;
+      cache->previous = mag;
+    }
+    else{
+      pthread_mutex_lock(&this->lock);
+      _deposit(this, cache->previous);
+      cache->previous = mag;
+      cache->loaded = _empty_magazine(this);
+      this->ntrips++;
+      pthread_mutex_unlock(&this->lock);
+    }
+    mag = cache->loaded;
+  }
+
+  __atomic_store_n(&cache->nfrees, cache->nfrees + 1, __ATOMIC_RELAXED);
+  mag->objs[mag->count++] = obj;
+}
+
+void slab_stats(slab_t* this, slab_stats_t* stats){
+  pthread_mutex_lock(&this->lock);
+  stats->nslabs = this->nslabs;
+  stats->capacity = this->nslabs * this->perslab;
+  stats->nallocs = this->nallocs;
+  stats->nfrees = this->nfrees;
+  stats->ntrips = this->ntrips;
+  for(slab_cache_t* cache = this->caches; cache != NULL; cache = cache->next){
+    stats->nallocs += __atomic_load_n(&cache->nallocs, __ATOMIC_RELAXED);
+    stats->nfrees += __atomic_load_n(&cache->nfrees, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&this->lock);
+
+  stats->inuse = stats->nallocs > stats->nfrees ? stats->nallocs - stats->nfrees : 0;
+}
+
+void slab_destroy(slab_t* this){
+  slab_magazine_t* lists[2] = {this->full, this->empty};
+
+  pthread_key_delete(this->key);
+  for(int i = 0; i < 2; i++){
+    while(lists[i] != NULL){
+      slab_magazine_t* next = lists[i]->next;
+      free(lists[i]);
+      lists[i] = next;
+    }
+  }
+  while(this->caches != NULL){
+    slab_cache_t* next = this->caches->next;
+    free(this->caches->loaded);
+    free(this->caches->previous);
+    free(this->caches);
+    this->caches = next;
+  }
+  while(this->slabs != NULL){
+    void* next = *(void**) this->slabs;
+    free(this->slabs);
+    this->slabs = next;
+  }
+  this->full = NULL;
+  this->empty = NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define SLAB_MAGAZINE 32
+
+typedef struct slab_magazine{
+  struct slab_magazine* next;
+  int count;
+  void* objs[SLAB_MAGAZINE];
+} slab_magazine_t;
+
+/* A thread's objects of one pool. Two magazines, so a thread that allocates
+   and frees around a magazine boundary doesn't go to the depot each time */
+typedef struct slab_cache{
+  struct slab_cache* next;
+  struct slab_pool* pool;
+  slab_magazine_t* loaded;
+  slab_magazine_t* previous;   /* always full or empty */
+  size_t nallocs;
+  size_t nfrees;
+} slab_cache_t;
+
+/*
+ * Fixed size objects carved from 64 byte aligned slabs. Every thread keeps
+ * magazines of free objects of its own, alloc and free only touch those.
+ * Full and empty magazines are traded with the shared depot under the lock,
+ * once per SLAB_MAGAZINE objects, and slabs are only malloc'ed when the
+ * depot runs dry. Objects are never given back to malloc before
+ * slab_destroy, so a thread may free what another one allocated.
+ */
+typedef struct slab_pool{
+  pthread_mutex_t lock;
+  pthread_key_t key;
+  size_t objsize;
+  size_t perslab;
+  void* slabs;                 /* every slab, linked through its first line */
+  size_t nslabs;
+  slab_magazine_t* full;       /* the depot: magazines holding objects */
+  slab_magazine_t* empty;
+  slab_cache_t* caches;        /* of the threads still running */
+  size_t nallocs;              /* of the threads gone */
+  size_t nfrees;
+  size_t ntrips;               /* magazines traded with the depot */
+} slab_t;
+
+typedef struct{
+  size_t nslabs;
+  size_t capacity;             /* objects carved so far */
+  size_t nallocs;
+  size_t nfrees;
+  size_t inuse;                /* allocated and not freed, leaked if nonzero at exit */
+  size_t ntrips;
+} slab_stats_t;
+
+/* Initializes a pool of objects of objsize bytes */
+void slab_init(slab_t* this, size_t objsize);
+
+/* Returns a free object from the calling thread's magazines */
+void* slab_alloc(slab_t* this);
+
+/* Gives back an object of this pool, allocated by any thread */
+void slab_free(slab_t* this, void* obj);
+
+/* Fills stats with the counts of every thread so far (a snapshot under concurrency) */
+void slab_stats(slab_t* this, slab_stats_t* stats);
+
+/* Frees every slab, whether its objects were freed or not */
+void slab_destroy(slab_t* this);
+
+#endif
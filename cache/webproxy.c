@@ -9,9 +9,13 @@
 #include <signal.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include "gfserver.h"
 #include "cache-student.h"
+#include "gftrace.h"
 
 /* note that the -n and -z parameters are NOT used for Part 1 */
 /* they are only used for Part 2 */
@@ -19,11 +23,28 @@
 "usage:\n"                                                                            \
 "  webproxy [options]\n"                                                              \
 "options:\n"                                                                          \
-"  -n [segment_count]  Number of segments to use (Default: 7)\n"                      \
+"  -B                  Busy poll for the cache instead of sleeping (needs dedicated cores)\n" \
+"  -c [cache_shards]   Number of simplecached shards (Default: 1, Range: 1-16)\n"     \
+"  -D [deadline_ms]    Longest wait for a segment or for the cache, 0 waits forever (Default: 10000)\n" \
+"  -H [backing]        Carve segments from huge pages: memfd or a hugetlbfs directory\n" \
+"  -I [idle_ms]        Park segments left unused this long (Default: 1000)\n"        \
+"  -k [kbytes]         Stack size of each worker thread (Default: the system's)\n"    \
+"  -L [listeners]      Webproxy processes sharing the listen port, each accepting on its own (Default: 1, Range: 1-64)\n" \
+"  -M [max_segments]   Most segments per shard the pool may grow to (Default: segment_count)\n" \
+"  -m [min_segments]   Fewest segments per shard the pool may shrink to (Default: segment_count)\n" \
+"  -N [namespace]      Names this webproxy's segments, letters and digits (Default: the pid)\n" \
+"  -n [segment_count]  Number of segments per shard at startup (Default: 7)\n"       \
+"  -W [wait_us]        Grow the pool when a request waits this long for a segment (Default: 1000)\n" \
+"  -P                  Pre-fault the segments at startup\n"                          \
 "  -p [listen_port]    Listen port (Default: 10823)\n"                                 \
+"  -Q [waiting]        Requests per shard that may wait for a segment, more fail at once (Default: 0, no limit)\n" \
+"  -S [stripes]        Segments a large file may be striped over (Default: 1, Range: 1-8)\n" \
+"  -T [trace_file]     Record every request (arrival, path, status, bytes, service time) for gfreplay\n" \
 "  -t [thread_count]   Num worker threads (Default: 34, Range: 1-420)\n"              \
 "  -s [server]         The server to connect to (Default: GitHub test data)\n"     \
-"  -z [segment_size]   The segment size (in bytes, Default: 5701).\n"                  \
+"  -u                  Place segments on NUMA nodes, served by workers of that node\n" \
+"  -w [cpus]           Pin worker threads round robin to a cpu list or node:N\n"     \
+"  -z [segment_size]   Payload bytes of each segment, its control block comes on top (Default: 5701).\n" \
 "  -h                  Show this help message\n"
 
 
@@ -31,10 +52,27 @@
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
         {"server",        required_argument,      NULL,           's'},
+        {"cache-shards",  required_argument,      NULL,           'c'},
         {"segment-count", required_argument,      NULL,           'n'},
+        {"min-segments",  required_argument,      NULL,           'm'},
+        {"max-segments",  required_argument,      NULL,           'M'},
+        {"grow-wait",     required_argument,      NULL,           'W'},
+        {"idle-time",     required_argument,      NULL,           'I'},
+        {"listeners",     required_argument,      NULL,           'L'},
+        {"deadline",      required_argument,      NULL,           'D'},
+        {"max-waiting",   required_argument,      NULL,           'Q'},
+        {"busy-poll",     no_argument,            NULL,           'B'},
+        {"namespace",     required_argument,      NULL,           'N'},
         {"thread-count",  required_argument,      NULL,           't'},
+        {"stack-size",    required_argument,      NULL,           'k'},
         {"listen-port",   required_argument,      NULL,           'p'},
         {"segment-size",  required_argument,      NULL,           'z'},
+        {"stripes",       required_argument,      NULL,           'S'},
+        {"trace",         required_argument,      NULL,           'T'},
+        {"huge-pages",    required_argument,      NULL,           'H'},
+        {"prefault",      no_argument,            NULL,           'P'},
+        {"numa",          no_argument,            NULL,           'u'},
+        {"worker-cpus",   required_argument,      NULL,           'w'},
         {"help",          no_argument,            NULL,           'h'},
         {"hidden",        no_argument,            NULL,           'i'}, /* server side */
         {NULL,            0,                      NULL,            0}
@@ -44,53 +82,450 @@ extern ssize_t handle_with_cache(gfcontext_t *ctx, char *path, void* arg);
 
 static gfserver_t gfs;
 
+static pid_t g_listeners[MAX_LISTENERS];
+static volatile sig_atomic_t g_stopSignal = 0;
+static int g_stopPipe[2] = {-1, -1}; // Carries a listener's stop from its signal handler to _stopper
+
+// Registers a webproxy with (or removes it from) the shard's cache. Mappings named after
+// regionPrefix go too. Gives up after a while, the cache may be down
+static void _send_control(mqd_t mq, int s, MSQKind_t kind, const char *nameSpace, const char *regionPrefix){
+    MSQRequest_t control;
+    struct timespec at;
+
+    bzero(&control, sizeof(control));
+    control.kind = kind;
+    shm_channel_namespace_prefix(control.filePath, sizeof(control.filePath), nameSpace);
+    if (regionPrefix)
+        snprintf(control.shmName, sizeof(control.shmName), "%s", regionPrefix);
+
+    clock_gettime(CLOCK_REALTIME, &at);
+    at.tv_sec++;
+    if (mq_timedsend(mq, (const char *) &control, sizeof(MSQRequest_t), 0, &at) == -1)
+        fprintf(stderr, "Unable to reach the cache of shard %d: %s \n", s, strerror(errno));
+}
+
+// gfserver binds its listening socket itself, so the listeners opt in to share the port here
+int __real_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
+
+int __wrap_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen){
+    if (g_webProxy.nListeners > 1){
+        int on = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0)
+            fprintf(stderr, "Unable to share the listen port: %s \n", strerror(errno));
+    }
+    return __real_bind(sockfd, addr, addrlen);
+}
+
+// What the handler sent, seen through gfs_sendheader and gfs_send for the trace
+static __thread gfstatus_t t_status;
+static __thread uint64_t t_bytes;
+
+ssize_t __real_gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len);
+ssize_t __real_gfs_send(gfcontext_t *ctx, void *data, size_t size);
+
+ssize_t __wrap_gfs_sendheader(gfcontext_t *ctx, gfstatus_t status, size_t file_len){
+    t_status = status;
+    return __real_gfs_sendheader(ctx, status, file_len);
+}
+
+ssize_t __wrap_gfs_send(gfcontext_t *ctx, void *data, size_t size){
+    ssize_t sent = __real_gfs_send(ctx, data, size);
+    if (sent > 0)
+        t_bytes += sent;
+    return sent;
+}
+
+// Serves the request and records it. Time spent queued in gfserver before the handler is not seen
+static ssize_t _traced_handler(gfcontext_t *ctx, const char *path, void *arg){
+    uint64_t arrival = shm_channel_clock_us();
+    ssize_t ret;
+
+    t_status = 0;
+    t_bytes = 0;
+    ret = handle_with_cache(ctx, (char*) path, arg);
+    gftrace_record(arrival, shm_channel_clock_us() - arrival, t_status, t_bytes, path);
+    return ret;
+}
+
+// Only passes the stop on: the slab and pool locks may be held by the thread it interrupted
 static void _sig_handler(int signo){
-    if (signo == SIGINT || signo == SIGTERM)
-    {
-        gfserver_stop(&gfs);
-        printf("Cleaning shared memories \n");
+    if (signo == SIGINT || signo == SIGTERM){
+        char stop = (char) signo;
 
-        //Cleanup
-        if (!proxy_lock){
-            if (pthread_cond_broadcast(&proxy_lock->cond) != 0){
-                printf("Function %s Line: %d Broadcast Failed with Error %d ! \n", __FUNCTION__, __LINE__, errno);
+        g_stopSignal = signo;
+        if (g_stopPipe[1] >= 0)
+            write(g_stopPipe[1], &stop, 1);
+    }
+}
+
+// Stops serving, reports and tears the segments down, outside of any signal handler
+static void _shutdown(int signo){
+    ShmHandoffStats_t stats;
+    slab_stats_t slabStats;
+
+    gfserver_stop(&gfs);
+    gftrace_flush();
+    shm_channel_handoff_stats(&stats);
+    printf("Cache handoffs: %lu immediate, %lu after spinning, %lu parked, %lu wakeups \n",
+           (unsigned long) stats.nImmediate, (unsigned long) stats.nSpun,
+           (unsigned long) stats.nParked, (unsigned long) stats.nWakes);
+    printf("Cleaning shared memories \n");
+
+    //Cleanup
+    for(int s = 0; s < g_webProxy.nShards; s++)
+    {
+        ContextShard_t *shard = &g_webProxy.shards[s];
+
+        if (shard->region){
+            fprintf(stdout, "Closing region %s \n", shard->regionName);
+            munmap(shard->region, shard->regionSize);
+            if (shard->regionFd >= 0)
+                close(shard->regionFd);
+            else
+                unlink(shard->regionName);
+        }
+        else {
+            for(int i = 0; i < shard->nCreated; i++)
+            {
+                char shmName[MAX_SHMNAME_LEN];
+                shm_channel_segment_name(shmName, sizeof(shmName), g_webProxy.nameSpace, s, i);
+                fprintf(stdout, "Closing SHM %s \n", shmName);
+                shm_unlink(shmName);
             }
         }
 
-        for(int i =0 ; i <= g_webProxy.nSegments; i++)
-        {
-            char shmName[MAX_SHMNAME_LEN];
-            sprintf(shmName, "%s%d", SHM_NAME, i);
-            fprintf(stdout, "Closing SHM %s \n", shmName);
+        // The queue is shared with other webproxies, only tell the cache we are gone
+        fprintf(stdout, "Close MQ %d with name %s \n", shard->mqRequest, shard->mqName);
+        _send_control(shard->mqRequest, s, MSQ_UNREGISTER, g_webProxy.nameSpace, shard->region ? shard->regionName : NULL);
+        mq_close(shard->mqRequest);
+
+        for(int i = 0; i < shard->nCreated; i++){
+            fprintf(stdout, "Successfully free segment item %d \n", i + 1);
+            slab_free(&g_webProxy.contexts, shard->segments[i]);
+        }
+        free(shard->segments);
+        for(int n = 0; n < g_webProxy.nNodes; n++)
+            ringq_destroy(&shard->segQueue[n]);
+        ringq_destroy(&shard->parked);
+        ringq_destroy(&shard->quarantine);
+    }
+
+    // Every context belongs to a segment and was freed above, anything left is a leak
+    slab_stats(&g_webProxy.contexts, &slabStats);
+    printf("Segment context slab: %zu allocated, %zu freed, %zu leaked \n",
+           slabStats.nallocs, slabStats.nfrees, slabStats.inuse);
+    slab_destroy(&g_webProxy.contexts);
+    exit(signo);
+}
+
+// Waits for a stop, which may have come before this thread was started
+static void *_stopper(void *arg){
+    char stop;
+
+    while (g_stopSignal == 0){
+        if (read(g_stopPipe[0], &stop, 1) < 0 && errno != EINTR)
+            return NULL;
+    }
+    _shutdown(g_stopSignal);
+    return NULL;
+}
+
+// Passes a stop on to every listener, the supervisor exits once they are all gone
+static void _supervisor_sig_handler(int signo){
+    g_stopSignal = signo;
+    for(int i = 0; i < g_webProxy.nListeners; i++)
+        if (g_listeners[i] > 0)
+            kill(g_listeners[i], signo);
+}
+
+static void _set_stop_handler(void (*handler)(int)){
+    signal(SIGINT, handler);
+    signal(SIGTERM, handler);
+}
+
+// Forks listener i with stops blocked, so neither side runs the other's handler. Returns 0 in the child
+static pid_t _fork_listener(int i){
+    pid_t supervisor = getpid();
+    sigset_t stops, old;
+    pid_t pid;
+
+    sigemptyset(&stops);
+    sigaddset(&stops, SIGINT);
+    sigaddset(&stops, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stops, &old);
+
+    if ((pid = fork()) < 0){
+        fprintf(stderr, "Error forking listener %d: %s \n", i, strerror(errno));
+        exit(SERVER_FAILURE);
+    }
+
+    if (pid == 0){
+        // A listener must not outlive its supervisor, nobody would restart or stop it
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != supervisor)
+            exit(SERVER_FAILURE);
+        _set_stop_handler(_sig_handler);
+    }
+    else
+        g_listeners[i] = pid;
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return pid;
+}
+
+// Listener i's namespace: ours with L and the index appended, room for it was checked with -N
+static void _listener_namespace(char nameSpace[MAX_NAMESPACE_LEN], int i){
+    char suffix[8];
+    size_t len = strlen(g_webProxy.nameSpace);
+
+    memmove(nameSpace, g_webProxy.nameSpace, len);
+    snprintf(suffix, sizeof(suffix), "L%d", i);
+    snprintf(nameSpace + len, MAX_NAMESPACE_LEN - len, "%s", suffix);
+}
+
+// Tells every shard's cache that a crashed listener is gone, it could not say so itself
+static void _unregister_listener(int nshards, const char *nameSpace, pid_t pid){
+    char regionPrefix[MAX_SHMNAME_LEN];
+
+    // A memfd region is reached through the dead listener's fd table
+    snprintf(regionPrefix, sizeof(regionPrefix), "/proc/%d/fd/", pid);
+
+    for(int s = 0; s < nshards; s++){
+        char mqName[MAX_SHMNAME_LEN];
+        mqd_t mq;
+
+        shm_channel_mq_name(mqName, sizeof(mqName), s);
+        if ((mq = mq_open(mqName, O_WRONLY)) < 0)
+            continue;
+        _send_control(mq, s, MSQ_UNREGISTER, nameSpace, regionPrefix);
+        mq_close(mq);
+    }
+}
+
+/*
+ * Starts nListeners webproxies on the same port. Each has its own gfserver,
+ * so its own socket, accept loop and request queue, and the kernel spreads
+ * the connections over them. Listeners that crash are replaced under the
+ * same namespace. Returns the listener index in the children; the caller
+ * stays behind as the supervisor and never returns.
+ */
+static int _prefork(int nshards){
+    int nAlive = g_webProxy.nListeners;
+
+    for(int i = 0; i < g_webProxy.nListeners; i++)
+        if (_fork_listener(i) == 0)
+            return i;
+
+    _set_stop_handler(_supervisor_sig_handler);
+    fprintf(stdout, "Started %d listeners \n", g_webProxy.nListeners);
+
+    while (nAlive > 0){
+        int status, i;
+        pid_t pid = waitpid(-1, &status, 0);
+
+        if (pid < 0){
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for(i = 0; i < g_webProxy.nListeners && g_listeners[i] != pid; i++)
+            ;
+        if (i == g_webProxy.nListeners)
+            continue;
+        g_listeners[i] = 0;
+        nAlive--;
+
+        if (g_stopSignal || !WIFSIGNALED(status) || WTERMSIG(status) == SIGINT || WTERMSIG(status) == SIGTERM){
+            fprintf(stdout, "Listener %d exited \n", i);
+            continue;
+        }
+
+        fprintf(stderr, "Listener %d died of signal %d, restarting it \n", i, WTERMSIG(status));
+        char nameSpace[MAX_NAMESPACE_LEN];
+        _listener_namespace(nameSpace, i);
+        _unregister_listener(nshards, nameSpace, pid);
+
+        // Don't spin if it dies right away
+        usleep(100000);
+        if (_fork_listener(i) == 0)
+            return i;
+        nAlive++;
+    }
+
+    exit(g_stopSignal);
+}
+
+static size_t _round_up(size_t len, size_t align){
+    return (len + align - 1) / align * align;
+}
+
+// Touches every page so the segment is faulted in at startup rather than on first request
+static void _prefault(char *addr, size_t len){
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    for(size_t off = 0; off < len; off += pageSize)
+        addr[off] = 0;
+}
+
+// Maps one huge page backed region that holds every segment of the shard
+static char *_map_region(ContextShard_t *shard, int s, const char *backing){
+    int fd;
+
+    if (strcmp(backing, "memfd") == 0){
+        char label[MAX_SHMNAME_LEN];
+        snprintf(label, sizeof(label), "webproxy_%s_%d", g_webProxy.nameSpace, s);
+        fd = memfd_create(label, MFD_HUGETLB);
+        // The region has no name, simplecached reaches it through our fd table
+        snprintf(shard->regionName, sizeof(shard->regionName), "/proc/%d/fd/%d", getpid(), fd);
+        shard->regionFd = fd;
+    }
+    else {
+        snprintf(shard->regionName, sizeof(shard->regionName), "%s/webproxy_%s_%d", backing, g_webProxy.nameSpace, s);
+        fd = open(shard->regionName, O_CREAT | O_RDWR, 0600);
+        shard->regionFd = -1;
+    }
+
+    if (fd < 0){
+        fprintf(stderr, "error: Failed to create huge page region %s: %s \n", shard->regionName, strerror(errno));
+        exit(SERVER_FAILURE);
+    }
+
+    if (ftruncate(fd, shard->regionSize) != 0){
+        fprintf(stderr, "error: Failed to size huge page region %s: %s \n", shard->regionName, strerror(errno));
+        exit(SERVER_FAILURE);
+    }
+
+    // Segments are faulted in as they are created, the pool may never use all of it
+    void *addr = mmap(NULL, shard->regionSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED){
+        fprintf(stderr, "ERROR: mmap failed for %s (are huge pages reserved?): %s \n", shard->regionName, strerror(errno));
+        exit(SERVER_FAILURE);
+    }
+
+    if (shard->regionFd < 0)
+        close(fd);
+
+    return (char*) addr;
+}
+
+ContextProxy_t *webproxy_add_segment(ContextShard_t *shard){
+    ContextProxy_t *proxy_req = (ContextProxy_t*) slab_alloc(&g_webProxy.contexts);
+    int i = shard->nCreated;
+    char shmName[MAX_SHMNAME_LEN];
+    bool numaPlacement = g_webProxy.isNumaPlaced;
+    bool prefault = g_webProxy.isPrefault;
+    size_t seglen = SHM_SEGMENT_LEN(g_webProxy.segmentSize);
+    void *addr;
+    int fdesc;
+
+    if (shard->region){
+        addr = shard->region + i * shard->stride;
+        memcpy(shmName, shard->regionName, sizeof(shmName));
+        proxy_req->shm_offset = i * shard->stride;
+        proxy_req->region_size = shard->regionSize;
+    }
+    else {
+        shm_channel_segment_name(shmName, sizeof(shmName), g_webProxy.nameSpace, shard->index, i);
+
+        // Also reached when the pool grows under load, where running out of shm must not be fatal
+        if ((fdesc = shm_open(shmName, O_CREAT | O_RDWR, 0600)) < 0){
+            fprintf(stderr, "error: Failed shm_open for %s: %s \n", shmName, strerror(errno));
+            slab_free(&g_webProxy.contexts, proxy_req);
+            return NULL;
+        }
+
+        addr = MAP_FAILED;
+        if (ftruncate(fdesc, seglen) == 0)
+            addr = mmap(NULL, seglen, PROT_READ | PROT_WRITE, MAP_SHARED | (prefault && !numaPlacement ? MAP_POPULATE : 0), fdesc, 0);
+        close(fdesc);
+        if (addr == MAP_FAILED){
+            fprintf(stderr, "ERROR: mmap failed for %s: %s \n", shmName, strerror(errno));
             shm_unlink(shmName);
+            slab_free(&g_webProxy.contexts, proxy_req);
+            return NULL;
         }
 
-        fprintf(stdout, "Close MQ %d with name %s \n", g_webProxy.mqRequest, MQ_REQUEST_NAME);
+        proxy_req->shm_offset = 0;
+        proxy_req->region_size = seglen;
+    }
+
+    // Spread segments over the nodes, binding before the control block is first touched
+    proxy_req->node = i % g_webProxy.nNodes;
+    if (numaPlacement)
+        shm_channel_bind_node(addr, shard->stride, proxy_req->node);
+    if (prefault && (numaPlacement || shard->region))
+        _prefault(addr, shard->stride);
+
+    proxy_req->shm_data = (char*) addr;
+    proxy_req->shm_context = (ContextShm_t*) ((char*) addr + SHM_CONTROL_OFFSET(g_webProxy.segmentSize));
+    proxy_req->last_used = shm_channel_clock_us();
+
+    //register SHM Details for cache
+    memcpy(proxy_req->shm_name, shmName, sizeof(shmName));
+    proxy_req->shm_context->status = 0;
+    proxy_req->shm_context->fileLen = 0;
+    proxy_req->shm_context->dataLen = 0;
+    proxy_req->shm_context->finished = 0;
+    proxy_req->shm_context->stripeTicket = 0;
+    proxy_req->shm_context->abandoned = 0;
+    shm_channel_handoff_init(&proxy_req->shm_context->semREAD, 0); //read
+    shm_channel_handoff_init(&proxy_req->shm_context->semWRITE, 1); //write
+
+    shard->segments[i] = proxy_req;
+    shard->nCreated++;
+    return proxy_req;
+}
 
-        mq_close(g_webProxy.mqRequest);
-        mq_unlink(MQ_REQUEST_NAME);
+// Gives the payload pages of a free segment back to the system. The page holding the control
+// block stays, so simplecached's mapping remains valid and the segment can come back without a new name
+static void _park_segment(ContextShard_t *shard, ContextProxy_t *proxy_req){
+    size_t pageSize = shard->region ? shm_channel_hugepage_size() : (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = _round_up((uintptr_t) proxy_req->shm_data, pageSize);
+    uintptr_t end = (uintptr_t) proxy_req->shm_context;
 
-        pthread_mutex_destroy(&proxy_lock->mutex);
-        pthread_cond_destroy(&proxy_lock->cond);
+    end -= end % pageSize;
+    if (end > start && madvise((void*) start, end - start, MADV_REMOVE) != 0)
+        fprintf(stderr, "madvise of %s failed with error %s \n", proxy_req->shm_name, strerror(errno));
 
-        int i = 1;
-        while(!steque_isempty(proxy_queue)){
-            ContextShm_t *ctxShm = steque_pop(proxy_queue);
-            if(ctxShm){
-                fprintf(stdout, "Successfully free queue item %d \n", i);
-                free(ctxShm);
+    ringq_enqueue(&shard->parked, proxy_req);
+}
+
+// Parks segments that sat free for longer than idleTime, keeping at least minSegments per shard
+static void *_pool_manager(void *arg){
+    uint64_t period = g_webProxy.idleTime / 2;
+
+    for(;;){
+        usleep(period > 10000 ? period : 10000);
+
+        for(int s = 0; s < g_webProxy.nShards; s++){
+            ContextShard_t *shard = &g_webProxy.shards[s];
+
+            for(int n = 0; n < g_webProxy.nNodes; n++){
+                size_t nFree = ringq_size(&shard->segQueue[n]);
+
+                for(size_t i = 0; i < nFree; i++){
+                    ContextProxy_t *proxy_req = (ContextProxy_t*) ringq_trydequeue(&shard->segQueue[n]);
+                    if (proxy_req == NULL)
+                        break;
+
+                    pthread_mutex_lock(&shard->growLock);
+                    if (shard->nActive > g_webProxy.minSegments && shm_channel_clock_us() - proxy_req->last_used > g_webProxy.idleTime){
+                        shard->nActive--;
+                        _park_segment(shard, proxy_req);
+                        proxy_req = NULL;
+                    }
+                    pthread_mutex_unlock(&shard->growLock);
+
+                    if (proxy_req)
+                        ringq_enqueue(&shard->segQueue[n], proxy_req);
+                    else
+                        fprintf(stdout, "Shard %d parked an idle segment, %zu active \n", s, shard->nActive);
+                }
             }
-            i++;
         }
-
-        if(proxy_queue)
-            steque_destroy(proxy_queue);
-        if (cache_queue)
-            steque_destroy(cache_queue);
-        if (proxy_lock)
-            free(proxy_lock);
     }
-    exit(signo);
+
+    return NULL;
 }
 
 /* Main ========================================================= */
@@ -99,6 +534,22 @@ int main(int argc, char **argv) {
     int option_char = 0;
     char *server = "https://raw.githubusercontent.com/gt-cs6200/image_data";
     unsigned int nsegments = 7;
+    unsigned int minsegments = 0;
+    unsigned int maxsegments = 0;
+    unsigned int growwait = 1000;
+    unsigned int idletime = 1000;
+    unsigned int deadline = 10000;
+    unsigned int maxwaiting = 0;
+    long stackKb = 0;
+    unsigned int nshards = 1;
+    unsigned int nstripes = 1;
+    unsigned int nlisteners = 1;
+    bool numaPlacement = false;
+    bool prefault = false;
+    char *backing = NULL;
+    char *workerCpus = NULL;
+    char *nameSpace = NULL;
+    char *traceFile = NULL;
     unsigned short port = 10823;
     unsigned short nworkerthreads = 34;
     size_t segsize = 5701;
@@ -117,7 +568,7 @@ int main(int argc, char **argv) {
     }
 
     /* Parse and set command line arguments */
-    while ((option_char = getopt_long(argc, argv, "s:qt:hn:xp:z:l", gLongOptions, NULL)) != -1) {
+    while ((option_char = getopt_long(argc, argv, "s:qt:hn:xp:z:lc:uw:H:PS:T:m:M:W:I:L:D:Q:BN:k:", gLongOptions, NULL)) != -1) {
         switch (option_char) {
             default:
                 fprintf(stderr, "%s", USAGE);
@@ -132,18 +583,69 @@ int main(int argc, char **argv) {
             case 's': // file-path
                 server = optarg;
                 break;
+            case 'c': // cache shards
+                nshards = atoi(optarg);
+                break;
+            case 'H': // huge page backing
+                backing = optarg;
+                prefault = true;
+                break;
+            case 'P': // prefault
+                prefault = true;
+                break;
+            case 'u': // numa placement
+                numaPlacement = true;
+                break;
+            case 'w': // worker cpus
+                workerCpus = optarg;
+                break;
             case 'n': // segment count
                 nsegments = atoi(optarg);
                 break;
+            case 'S': // stripes
+                nstripes = atoi(optarg);
+                break;
+            case 'T': // trace
+                traceFile = optarg;
+                break;
+            case 'm': // min segments
+                minsegments = atoi(optarg);
+                break;
+            case 'M': // max segments
+                maxsegments = atoi(optarg);
+                break;
+            case 'W': // grow wait
+                growwait = atoi(optarg);
+                break;
+            case 'I': // idle time
+                idletime = atoi(optarg);
+                break;
+            case 'L': // listeners
+                nlisteners = atoi(optarg);
+                break;
+            case 'D': // deadline
+                deadline = atoi(optarg);
+                break;
+            case 'Q': // max waiting
+                maxwaiting = atoi(optarg);
+                break;
+            case 'B': // busy poll
+                shm_channel_handoff_set_polling(true);
+                break;
+            case 'N': // namespace
+                nameSpace = optarg;
+                break;
             case 'z': // segment size
                 segsize = atoi(optarg);
                 break;
             case 't': // thread-count
                 nworkerthreads = atoi(optarg);
                 break;
+            case 'k': // stack size
+                stackKb = atol(optarg);
+                break;
             case 'i':
             case 'y':
-            case 'k':
                 break;
         }
     }
@@ -168,22 +670,91 @@ int main(int argc, char **argv) {
         exit(__LINE__);
     }
 
+    if (minsegments == 0)
+        minsegments = nsegments;
+    if (maxsegments == 0)
+        maxsegments = nsegments;
+    if ((minsegments > nsegments) || (nsegments > maxsegments)) {
+        fprintf(stderr, "Segment count must be within the min and max segments\n");
+        exit(__LINE__);
+    }
+
+    if ((nshards < 1) || (nshards > MAX_SHARDS)) {
+        fprintf(stderr, "Invalid number of cache shards\n");
+        exit(__LINE__);
+    }
+
+    if ((nstripes < 1) || (nstripes > MAX_STRIPES)) {
+        fprintf(stderr, "Invalid number of stripes\n");
+        exit(__LINE__);
+    }
+
     if ((nworkerthreads < 1) || (nworkerthreads > 420)) {
         fprintf(stderr, "Invalid number of worker threads\n");
         exit(__LINE__);
     }
 
+    if ((stackKb != 0) && (stackKb < (long) PTHREAD_STACK_MIN / 1024)) {
+        fprintf(stderr, "Stack size must be at least %ld kbytes\n", (long) PTHREAD_STACK_MIN / 1024);
+        exit(__LINE__);
+    }
+
+    if ((nlisteners < 1) || (nlisteners > MAX_LISTENERS)) {
+        fprintf(stderr, "Invalid number of listeners\n");
+        exit(__LINE__);
+    }
+
+    // The cache tells webproxies apart by segment name prefix, so no separators in here.
+    // Listeners append L and their index to it
+    if (nameSpace == NULL)
+        snprintf(g_webProxy.nameSpace, sizeof(g_webProxy.nameSpace), "%d", getpid());
+    else if (nameSpace[0] == '\0' || strlen(nameSpace) + (nlisteners > 1 ? 3 : 0) >= MAX_NAMESPACE_LEN ||
+             strspn(nameSpace, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") != strlen(nameSpace)) {
+        fprintf(stderr, "Invalid namespace %s\n", nameSpace);
+        exit(__LINE__);
+    }
+    else
+        snprintf(g_webProxy.nameSpace, sizeof(g_webProxy.nameSpace), "%s", nameSpace);
+
+    // Opened before forking, every listener appends to the one trace
+    if (traceFile && gftrace_open(traceFile) != 0){
+        fprintf(stderr, "Unable to create trace %s: %s\n", traceFile, strerror(errno));
+        exit(__LINE__);
+    }
+
+    // From here on each listener sets up as a webproxy of its own
+    g_webProxy.nListeners = nlisteners;
+    if (nlisteners > 1){
+        int listener = _prefork(nshards);
+        _listener_namespace(g_webProxy.nameSpace, listener);
+    }
+
     // Initialize shared memory set-up here
     g_webProxy.nSegments = nsegments;
+    g_webProxy.minSegments = minsegments;
+    g_webProxy.maxSegments = maxsegments;
+    g_webProxy.waitTarget = growwait;
+    g_webProxy.idleTime = (uint64_t) idletime * 1000;
+    g_webProxy.deadline = (uint64_t) deadline * 1000;
+    g_webProxy.maxWaiting = maxwaiting;
+    g_webProxy.isPrefault = prefault;
+    g_webProxy.isNumaPlaced = numaPlacement;
     g_webProxy.segmentSize = segsize;
-
-    proxy_queue = (steque_t*) malloc(sizeof(steque_t));
-    steque_init(proxy_queue);
-
-    //Create global mutex
-    proxy_lock = (lock_t*) malloc(sizeof(lock_t));
-    pthread_cond_init(&proxy_lock->cond, NULL);
-    pthread_mutex_init(&proxy_lock->mutex, NULL);
+    g_webProxy.nShards = nshards;
+    shm_channel_ring_init(&g_webProxy.ring, nshards);
+    slab_init(&g_webProxy.contexts, sizeof(ContextProxy_t));
+    g_webProxy.nNodes = numaPlacement ? shm_channel_numa_nodes() : 1;
+    g_webProxy.nStripes = nstripes;
+    // Start above any ticket a previous webproxy of the same namespace may have left queued
+    g_webProxy.nextTicket = shm_channel_clock_us() << 8;
+
+    if (workerCpus){
+        if (shm_channel_parse_cpuset(workerCpus, &g_webProxy.workerCpus) != 0){
+            fprintf(stderr, "Invalid worker cpu list %s\n", workerCpus);
+            exit(__LINE__);
+        }
+        g_webProxy.isPinned = true;
+    }
 
     struct mq_attr attr;
     attr.mq_flags = 0;
@@ -191,58 +762,92 @@ int main(int argc, char **argv) {
     attr.mq_msgsize = MAX_MSG_SIZE;
     attr.mq_curmsgs = 0;
 
-
-    int fdesc;
-    for(int i = 0; i < nsegments; i++) {
-        ContextProxy_t *proxy_req = (ContextProxy_t*) malloc (sizeof(ContextProxy_t));
-        char shmName[MAX_SHMNAME_LEN];
-        sprintf(shmName, "%s%d", SHM_NAME, i);
-
-        if ((fdesc = shm_open(shmName, O_CREAT | O_RDWR, 0600)) < 0){
-            fprintf(stderr, "error: Failed shm_open for %s \n", shmName);
+    for(int s = 0; s < nshards; s++) {
+        ContextShard_t *shard = &g_webProxy.shards[s];
+
+        shard->index = s;
+        for(int n = 0; n < g_webProxy.nNodes; n++)
+            ringq_init(&shard->segQueue[n], maxsegments);
+        ringq_init(&shard->parked, maxsegments);
+        ringq_init(&shard->quarantine, maxsegments);
+        shard->segments = (ContextProxy_t**) calloc(maxsegments, sizeof(ContextProxy_t*));
+        pthread_mutex_init(&shard->growLock, NULL);
+        pthread_mutex_init(&shard->attachLock, NULL);
+
+        // Carve the segments out of a single huge page region, with room for the largest pool.
+        // Every payload starts on a page, segments that get bound to a node must cover whole
+        // huge pages for mbind to accept them
+        shard->stride = SHM_SEGMENT_LEN(segsize);
+        if (backing){
+            shard->stride = _round_up(SHM_SEGMENT_LEN(segsize), numaPlacement ? shm_channel_hugepage_size() : (size_t) sysconf(_SC_PAGESIZE));
+            shard->regionSize = _round_up(shard->stride * maxsegments, shm_channel_hugepage_size());
+            shard->region = _map_region(shard, s, backing);
         }
 
-        ftruncate(fdesc, segsize);
-
-        void* addr = mmap(NULL, segsize, PROT_READ | PROT_WRITE, MAP_SHARED, fdesc, 0);
-        if (addr == MAP_FAILED){
-            fprintf(stderr, "ERROR: mmap failed for %d \n", i);
+        for(int i = 0; i < nsegments; i++){
+            ContextProxy_t *proxy_req = webproxy_add_segment(shard);
+            if (proxy_req == NULL)
+                exit(SERVER_FAILURE);
+            ringq_enqueue(&shard->segQueue[proxy_req->node], proxy_req);
         }
+        shard->nActive = nsegments;
 
-        proxy_req->shm_context = (ContextShm_t*) addr;
-
-        //register SHM Details for cache
-        ((ContextShm_t*) addr)->dataLen = 0;
-        memcpy(proxy_req->shm_name, shmName, sizeof(shmName));
-        bzero(((ContextShm_t*) addr)->filePath, MAX_PATH_LEN);
-        ((ContextShm_t*) addr)->fileLen = 0;
-        sem_init(&((ContextShm_t*) addr)->semREAD, 1, 0); //read
-        sem_init(&((ContextShm_t*) addr)->semWRITE, 1, 1); //write
+        // Open the shard's request queue, shared with any other webproxy (must after the malloc above, otherwise memory leakage)
+        shm_channel_mq_name(shard->mqName, sizeof(shard->mqName), s);
+        if((shard->mqRequest = mq_open(shard->mqName, O_RDWR | O_CREAT , 0666, &attr)) < 0){
+            printf("Error: mq_open %s failed errcode %s\n", shard->mqName, strerror(errno));
+            exit(SERVER_FAILURE);
+        }
+        _send_control(shard->mqRequest, s, MSQ_REGISTER, g_webProxy.nameSpace, shard->region ? shard->regionName : NULL);
+    }
 
-        if (proxy_queue){
-            pthread_mutex_lock(&proxy_lock->mutex);
-            steque_enqueue(proxy_queue, proxy_req);
-            pthread_mutex_unlock(&proxy_lock->mutex);
+    // Only an elastic pool needs someone to park idle segments
+    if (minsegments < maxsegments){
+        pthread_t manager;
+        if (pthread_create(&manager, NULL, _pool_manager, NULL) != 0){
+            fprintf(stderr, "Error creating segment pool manager\n");
+            exit(SERVER_FAILURE);
         }
+        pthread_detach(manager);
     }
 
-    // Create Message Queue Request and Response (must after the malloc above, otherwise memory leakage)
-    if((g_webProxy.mqRequest = mq_open(MQ_REQUEST_NAME, O_RDWR | O_CREAT , 0666, &attr)) < 0){
-        printf("Error: mq_open %s failed errcode %s\n", MQ_REQUEST_NAME, strerror(errno));
+    // Per listener, a pipe inherited from the supervisor would hand one listener's stop to another
+    pthread_t stopper;
+    if (pipe(g_stopPipe) != 0 || pthread_create(&stopper, NULL, _stopper, NULL) != 0){
+        fprintf(stderr, "Error creating the stop thread\n");
         exit(SERVER_FAILURE);
     }
+    pthread_detach(stopper);
+
+    // gfserver starts its worker threads with default attributes, this is the one way to size their stacks
+    if (stackKb > 0){
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (pthread_attr_setstacksize(&attr, (size_t) stackKb * 1024) != 0 || pthread_setattr_default_np(&attr) != 0){
+            fprintf(stderr, "Invalid stack size %ld kbytes\n", stackKb);
+            exit(__LINE__);
+        }
+        pthread_attr_destroy(&attr);
+    }
 
     // Initialize server structure here
     gfserver_init(&gfs, nworkerthreads);
 
     // Set server options here
     gfserver_setopt(&gfs, GFS_PORT, port);
-    gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_cache);
+    if (traceFile)
+        gfserver_setopt(&gfs, GFS_WORKER_FUNC, _traced_handler);
+    else
+        gfserver_setopt(&gfs, GFS_WORKER_FUNC, handle_with_cache);
     gfserver_setopt(&gfs, GFS_MAXNPENDING, 314);
 
     // Set up arguments for worker here
+    ContextWorker_t *workers = (ContextWorker_t*) malloc(nworkerthreads * sizeof(ContextWorker_t));
     for(int i = 0; i < nworkerthreads; i++) {
-        gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &g_webProxy);
+        workers[i].webProxy = &g_webProxy;
+        workers[i].index = i;
+        workers[i].node = -1;
+        gfserver_setopt(&gfs, GFS_WORKER_ARG, i, &workers[i]);
     }
 
     // Invoke the framework - this is an infinite loop and shouldn't return
@@ -0,0 +1,332 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "workpool.h"
+
+#if !defined(WORKPOOL_FAILURE)
+#define WORKPOOL_FAILURE (-1)
+#endif // WORKPOOL_FAILURE
+
+#define STEAL_MAX 32
+#define EXPRESS_BURST 8 // Express jobs a worker takes before looking at its deque again
+
+static uint64_t _clock_ns(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int _push_back(workpool_deque_t* deque, workpool_item item){
+  if(deque->count == deque->cap)
+    return -1;
+  deque->items[(deque->head + deque->count) % deque->cap] = item;
+  deque->count++;
+  return 0;
+}
+
+static workpool_item _pop_front(workpool_deque_t* deque){
+  workpool_item item = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if(deque->count > 0){
+    item = deque->items[deque->head];
+    deque->head = (deque->head + 1) % deque->cap;
+    deque->count--;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return item;
+}
+
+/* Moves up to half of the victim's newest items into the thief's deque. Both
+   locks are held, in address order, so only what fits there leaves the victim */
+static workpool_item _steal(workpool_t* this, workpool_deque_t* victim, workpool_deque_t* thief){
+  workpool_deque_t* first = victim < thief ? victim : thief;
+  workpool_deque_t* second = victim < thief ? thief : victim;
+  workpool_item item = NULL;
+  size_t n = 0;
+
+  pthread_mutex_lock(&first->lock);
+  pthread_mutex_lock(&second->lock);
+  if(victim->count > 0){
+    n = (victim->count + 1) / 2;
+    if(n > STEAL_MAX)
+      n = STEAL_MAX;
+    /* Submitters may have filled the thief's deque since it came up empty */
+    if(n - 1 > thief->cap - thief->count)
+      n = thief->cap - thief->count + 1;
+    victim->count -= n;
+
+    /* Keep the oldest of the loot for ourselves, queue the rest oldest first */
+    item = victim->items[(victim->head + victim->count) % victim->cap];
+    for(size_t i = 1; i < n; i++)
+      _push_back(thief, victim->items[(victim->head + victim->count + i) % victim->cap]);
+  }
+  pthread_mutex_unlock(&second->lock);
+  pthread_mutex_unlock(&first->lock);
+
+  if(n > 0)
+    __atomic_fetch_add(&this->nsteals, 1, __ATOMIC_RELAXED);
+  return item;
+}
+
+static void _wake(uint32_t* event, uint32_t* sleepers, int n){
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(sleepers, __ATOMIC_SEQ_CST) > 0){
+    __atomic_fetch_add(event, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, event, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+  }
+}
+
+static workpool_item _find(workpool_t* this, int worker){
+  workpool_deque_t* own = &this->deques[worker];
+  workpool_item item;
+
+  if(own->expressRun < EXPRESS_BURST && (item = ringq_trydequeue(&this->express)) != NULL){
+    own->expressRun++;
+    return item;
+  }
+  own->expressRun = 0;
+
+  if((item = _pop_front(own)) != NULL)
+    return item;
+
+  if((item = ringq_trydequeue(&this->express)) != NULL)
+    return item;
+
+  /* Steal from workers of our own node first, then from anybody */
+  for(int pass = 0; pass < 2; pass++){
+    for(int i = 1; i < this->nworkers; i++){
+      workpool_deque_t* victim = &this->deques[(worker + i) % this->nworkers];
+      if((victim->node == own->node) != (pass == 0))
+        continue;
+      if(__atomic_load_n(&victim->count, __ATOMIC_RELAXED) == 0)
+        continue;
+      if((item = _steal(this, victim, own)) != NULL)
+        return item;
+    }
+  }
+  return NULL;
+}
+
+void workpool_init(workpool_t* this, int nworkers, size_t capacity){
+  this->deques = (workpool_deque_t*) calloc(nworkers, sizeof(workpool_deque_t));
+  if(this->deques == NULL){
+    fprintf(stderr, "Error: unable to allocate workpool of %d workers.\n", nworkers);
+    fflush(stderr);
+    exit(WORKPOOL_FAILURE);
+  }
+
+  for(int i = 0; i < nworkers; i++){
+    pthread_mutex_init(&this->deques[i].lock, NULL);
+    this->deques[i].items = (workpool_item*) malloc(capacity * sizeof(workpool_item));
+    this->deques[i].cap = capacity;
+  }
+
+  this->nworkers = nworkers;
+  this->next = 0;
+  this->event = 0;
+  this->sleepers = 0;
+  this->closed = 0;
+  this->nsteals = 0;
+  ringq_init(&this->express, nworkers * capacity);
+  this->expressEvent = 0;
+  this->expressSleepers = 0;
+  for(int i = 0; i < nworkers; i++)
+    this->deques[i].active = 1;
+  this->nactive = nworkers;
+  this->minWorkers = nworkers;
+  this->idleTimeout = 0;
+  this->lastTake = _clock_ns();
+}
+
+void workpool_set_node(workpool_t* this, int worker, int node){
+  this->deques[worker].node = node;
+}
+
+void workpool_reserve(workpool_t* this, int worker){
+  this->deques[worker].reserved = 1;
+}
+
+void workpool_set_elastic(workpool_t* this, int minWorkers, unsigned idleMs){
+  for(int i = minWorkers; i < this->nworkers; i++)
+    this->deques[i].active = 0;
+  this->nactive = minWorkers;
+  this->minWorkers = minWorkers;
+  this->idleTimeout = (uint64_t) idleMs * 1000000;
+}
+
+int workpool_wants_worker(workpool_t* this, unsigned waitMs){
+  int nactive = __atomic_load_n(&this->nactive, __ATOMIC_RELAXED);
+  size_t pending;
+
+  if(nactive == this->nworkers || __atomic_load_n(&this->sleepers, __ATOMIC_SEQ_CST) > 0)
+    return -1;
+  if((pending = workpool_pending(this)) == 0)
+    return -1;
+  if(pending <= (size_t) nactive &&
+     _clock_ns() - __atomic_load_n(&this->lastTake, __ATOMIC_RELAXED) < (uint64_t) waitMs * 1000000)
+    return -1;
+
+  for(int i = 0; i < this->nworkers; i++)
+    if(!__atomic_load_n(&this->deques[i].active, __ATOMIC_ACQUIRE))
+      return i;
+  return -1;
+}
+
+void workpool_activate(workpool_t* this, int worker){
+  __atomic_store_n(&this->deques[worker].active, 1, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&this->nactive, 1, __ATOMIC_RELAXED);
+}
+
+/* Takes worker out of the pool unless that would leave fewer than the minimum
+   or its deque got a batch meanwhile. Submitters check active under the same
+   lock, so nothing is left behind in the deque */
+static int _retire(workpool_t* this, int worker){
+  workpool_deque_t* deque = &this->deques[worker];
+  int nactive = __atomic_load_n(&this->nactive, __ATOMIC_RELAXED);
+  int retired = 0;
+
+  do{
+    if(deque->reserved || nactive <= this->minWorkers)
+      return 0;
+  }while(!__atomic_compare_exchange_n(&this->nactive, &nactive, nactive - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  pthread_mutex_lock(&deque->lock);
+  if(deque->count == 0){
+    __atomic_store_n(&deque->active, 0, __ATOMIC_RELEASE);
+    retired = 1;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  if(!retired)
+    __atomic_fetch_add(&this->nactive, 1, __ATOMIC_RELAXED);
+  return retired;
+}
+
+void workpool_submit(workpool_t* this, workpool_item* items, int n, int node){
+  int queued = 0;
+  size_t start = __atomic_fetch_add(&this->next, 1, __ATOMIC_RELAXED);
+
+  while(queued < n){
+    /* Walk from the cursor to the first worker of the node with room left */
+    for(int pass = 0; pass < 2 && queued < n; pass++){
+      for(int i = 0; i < this->nworkers && queued < n; i++){
+        workpool_deque_t* deque = &this->deques[(start + i) % this->nworkers];
+        if(deque->reserved || !deque->active || (pass == 0 && deque->node != node))
+          continue;
+        pthread_mutex_lock(&deque->lock);
+        while(queued < n && deque->active && _push_back(deque, items[queued]) == 0)
+          queued++;
+        pthread_mutex_unlock(&deque->lock);
+      }
+    }
+    if(queued < n)
+      usleep(100);
+  }
+
+  _wake(&this->event, &this->sleepers, n);
+}
+
+void workpool_submit_express(workpool_t* this, workpool_item item){
+  while(ringq_tryenqueue(&this->express, item) != 0)
+    usleep(100);
+
+  /* Prefer an idle reserved worker, any idle worker will do otherwise */
+  if(__atomic_load_n(&this->expressSleepers, __ATOMIC_SEQ_CST) > 0)
+    _wake(&this->expressEvent, &this->expressSleepers, 1);
+  else
+    _wake(&this->event, &this->sleepers, 1);
+}
+
+workpool_item workpool_take(workpool_t* this, int worker){
+  workpool_item item;
+  uint64_t idleSince = 0;
+
+  while((item = _find(this, worker)) == NULL){
+    uint32_t event = __atomic_load_n(&this->event, __ATOMIC_SEQ_CST);
+    struct timespec timeout, *wait = NULL;
+
+    if(__atomic_load_n(&this->closed, __ATOMIC_SEQ_CST))
+      return NULL;
+
+    /* Idle time counts from the first empty look, wakeups that find nothing don't reset it */
+    if(this->idleTimeout > 0){
+      uint64_t now = _clock_ns();
+      if(idleSince == 0)
+        idleSince = now;
+      if(now - idleSince >= this->idleTimeout && _retire(this, worker))
+        return NULL;
+      if(now - idleSince < this->idleTimeout){
+        timeout.tv_sec = (this->idleTimeout - (now - idleSince)) / 1000000000;
+        timeout.tv_nsec = (this->idleTimeout - (now - idleSince)) % 1000000000;
+        wait = &timeout;
+      }
+    }
+
+    /* Announce ourselves before the last look so a submit can't miss us */
+    __atomic_fetch_add(&this->sleepers, 1, __ATOMIC_SEQ_CST);
+    if((item = _find(this, worker)) != NULL){
+      __atomic_fetch_sub(&this->sleepers, 1, __ATOMIC_SEQ_CST);
+      return item;
+    }
+    syscall(SYS_futex, &this->event, FUTEX_WAIT_PRIVATE, event, wait, NULL, 0);
+    __atomic_fetch_sub(&this->sleepers, 1, __ATOMIC_SEQ_CST);
+  }
+
+  if(this->idleTimeout > 0)
+    __atomic_store_n(&this->lastTake, _clock_ns(), __ATOMIC_RELAXED);
+  return item;
+}
+
+workpool_item workpool_take_express(workpool_t* this){
+  workpool_item item;
+
+  while((item = ringq_trydequeue(&this->express)) == NULL){
+    uint32_t event = __atomic_load_n(&this->expressEvent, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&this->closed, __ATOMIC_SEQ_CST))
+      return NULL;
+
+    __atomic_fetch_add(&this->expressSleepers, 1, __ATOMIC_SEQ_CST);
+    if((item = ringq_trydequeue(&this->express)) != NULL){
+      __atomic_fetch_sub(&this->expressSleepers, 1, __ATOMIC_SEQ_CST);
+      return item;
+    }
+    syscall(SYS_futex, &this->expressEvent, FUTEX_WAIT_PRIVATE, event, NULL, NULL, 0);
+    __atomic_fetch_sub(&this->expressSleepers, 1, __ATOMIC_SEQ_CST);
+  }
+
+  return item;
+}
+
+size_t workpool_pending(workpool_t* this){
+  size_t pending = ringq_size(&this->express);
+
+  for(int i = 0; i < this->nworkers; i++)
+    pending += __atomic_load_n(&this->deques[i].count, __ATOMIC_RELAXED);
+  return pending;
+}
+
+void workpool_close(workpool_t* this){
+  __atomic_store_n(&this->closed, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&this->event, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&this->expressEvent, 1, __ATOMIC_SEQ_CST);
+  syscall(SYS_futex, &this->event, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  syscall(SYS_futex, &this->expressEvent, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void workpool_destroy(workpool_t* this){
+  for(int i = 0; i < this->nworkers; i++){
+    pthread_mutex_destroy(&this->deques[i].lock);
+    free(this->deques[i].items);
+  }
+  free(this->deques);
+  this->deques = NULL;
+  ringq_destroy(&this->express);
+}
@@ -0,0 +1,94 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ringq.h"
+
+typedef void* workpool_item;
+
+/*
+ * One deque per worker. Batches are appended at the back, the owner takes
+ * from the front and thieves take the newest half from the back. Each deque
+ * has its own lock, so workers only contend when one of them steals.
+ */
+typedef struct{
+  pthread_mutex_t lock;
+  workpool_item* items;
+  size_t cap;
+  size_t head;
+  size_t count;
+  int node;
+  int reserved;         /* serves only the express lane, gets no batches */
+  int active;           /* has a running worker, only active deques get batches */
+  int expressRun;       /* express jobs taken in a row, bounds large job starvation */
+  char pad[64];
+} workpool_deque_t;
+
+typedef struct{
+  workpool_deque_t* deques;
+  int nworkers;
+  size_t next;          /* round robin cursor for submitted batches */
+  uint32_t event;       /* futex word idle workers park on */
+  uint32_t sleepers;
+  int closed;
+  size_t nsteals;
+  ringq_t express;      /* short jobs, served before any deque */
+  uint32_t expressEvent;
+  uint32_t expressSleepers;
+  int nactive;
+  int minWorkers;       /* active workers never retire below this */
+  uint64_t idleTimeout; /* ns a worker idles before it retires, 0 never */
+  uint64_t lastTake;    /* CLOCK_MONOTONIC ns of the last item taken */
+} workpool_t;
+
+/* Initializes a pool of nworkers deques holding capacity items each */
+void workpool_init(workpool_t* this, int nworkers, size_t capacity);
+
+/* Records the NUMA node of a worker, batches for a node go to its workers */
+void workpool_set_node(workpool_t* this, int worker, int node);
+
+/* Reserves a worker for the express lane, it is skipped by workpool_submit */
+void workpool_reserve(workpool_t* this, int worker);
+
+/* Makes the pool elastic: only the first minWorkers workers start active,
+   and a worker above them that idles for idleMs retires. Reserved workers
+   must be among the first minWorkers */
+void workpool_set_elastic(workpool_t* this, int minWorkers, unsigned idleMs);
+
+/* Returns an inactive worker to start when no active one is idle and more
+   items are queued than there are active workers, or the queue has not
+   moved for waitMs. -1 if the pool should not grow */
+int workpool_wants_worker(workpool_t* this, unsigned waitMs);
+
+/* Marks worker active again, before its thread is started */
+void workpool_activate(workpool_t* this, int worker);
+
+/* Hands a batch of n items to the next worker on node (any worker if the
+   node has none), spilling to other workers when that deque is full */
+void workpool_submit(workpool_t* this, workpool_item* items, int n, int node);
+
+/* Queues a short job on the express lane shared by all workers */
+void workpool_submit_express(workpool_t* this, workpool_item item);
+
+/* Returns the next item for worker: the express lane first, then its own
+   deque, then stealing, parking when there is nothing at all.
+   Returns NULL once closed, or once the worker retired after idling in an
+   elastic pool; either way its thread should exit */
+workpool_item workpool_take(workpool_t* this, int worker);
+
+/* Like workpool_take, for workers reserved to the express lane */
+workpool_item workpool_take_express(workpool_t* this);
+
+/* Returns the number of queued items (a snapshot under concurrency) */
+size_t workpool_pending(workpool_t* this);
+
+/* Closes the pool and wakes every parked worker */
+void workpool_close(workpool_t* this);
+
+/* Frees the deques. Items still queued are not touched */
+void workpool_destroy(workpool_t* this);
+
+#endif
@@ -0,0 +1,262 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "diskcache.h"
+
+#define DISKCACHE_MAGIC "GFDISK1"
+#define MAX_REFRESHING 64
+
+static char cacheDir[PATH_MAX];
+static bool isEnabled = false;
+static int64_t defaultStaleWindow = 0;
+
+// Serializes header reads against the in place rewrite of a revalidation
+static pthread_mutex_t headerLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t refreshLock = PTHREAD_MUTEX_INITIALIZER;
+static char refreshing[MAX_REFRESHING][DISKCACHE_MAX_PATH];
+
+int diskcache_init(const char *dir, int64_t staleWindow){
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        return -1;
+    snprintf(cacheDir, sizeof(cacheDir), "%s", dir);
+    defaultStaleWindow = staleWindow;
+    isEnabled = true;
+    return 0;
+}
+
+bool diskcache_enabled(void){
+    return isEnabled;
+}
+
+// FNV-1a names the file, the header keeps the path to catch collisions
+static void _entry_name(char *name, size_t len, const char *path){
+    uint64_t hash = 14695981039346656037ULL;
+
+    for (const char *c = path; *c; c++)
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    snprintf(name, len, "%s/%016llx.entry", cacheDir, (unsigned long long) hash);
+}
+
+void diskcache_meta_init(diskcache_meta_t *meta){
+    memset(meta, 0, sizeof(*meta));
+    meta->maxAge = -1;
+    meta->staleWindow = -1;
+}
+
+// Copies a header value without its surrounding blanks and line ending
+static void _copy_value(char *dst, size_t dstLen, const char *value, size_t len){
+    while (len > 0 && isspace((unsigned char) *value)){
+        value++;
+        len--;
+    }
+    while (len > 0 && isspace((unsigned char) value[len - 1]))
+        len--;
+    if (len >= dstLen)
+        len = dstLen - 1;
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+static void _parse_cache_control(diskcache_meta_t *meta, const char *value){
+    char directives[512];
+    char *token, *save;
+    int64_t maxAge = -1, sharedMaxAge = -1;
+    bool noCache = false;
+
+    snprintf(directives, sizeof(directives), "%s", value);
+    for (token = strtok_r(directives, ", ", &save); token; token = strtok_r(NULL, ", ", &save)){
+        if (strncasecmp(token, "s-maxage=", 9) == 0)
+            sharedMaxAge = atoll(token + 9);
+        else if (strncasecmp(token, "max-age=", 8) == 0)
+            maxAge = atoll(token + 8);
+        else if (strncasecmp(token, "stale-while-revalidate=", 23) == 0)
+            meta->staleWindow = atoll(token + 23);
+        else if (strcasecmp(token, "no-cache") == 0)
+            noCache = true;
+        else if (strcasecmp(token, "no-store") == 0 || strcasecmp(token, "private") == 0)
+            meta->noStore = true;
+    }
+
+    // We are a shared cache: s-maxage wins over max-age, no-cache means revalidate every time
+    if (noCache)
+        meta->maxAge = 0;
+    else if (sharedMaxAge >= 0)
+        meta->maxAge = sharedMaxAge;
+    else if (maxAge >= 0)
+        meta->maxAge = maxAge;
+}
+
+void diskcache_parse_header(diskcache_meta_t *meta, const char *line, size_t len){
+    char value[512];
+    const char *colon = memchr(line, ':', len);
+    size_t nameLen, valueLen;
+
+    if (colon == NULL)
+        return;
+    nameLen = colon - line;
+    valueLen = len - nameLen - 1;
+
+    if (nameLen == 13 && strncasecmp(line, "Cache-Control", 13) == 0){
+        _copy_value(value, sizeof(value), colon + 1, valueLen);
+        _parse_cache_control(meta, value);
+    }
+    else if (nameLen == 4 && strncasecmp(line, "ETag", 4) == 0)
+        _copy_value(meta->etag, sizeof(meta->etag), colon + 1, valueLen);
+    else if (nameLen == 13 && strncasecmp(line, "Last-Modified", 13) == 0)
+        _copy_value(meta->lastModified, sizeof(meta->lastModified), colon + 1, valueLen);
+}
+
+bool diskcache_storable(const diskcache_meta_t *meta){
+    if (meta->noStore)
+        return false;
+    return meta->maxAge > 0 || meta->etag[0] || meta->lastModified[0];
+}
+
+diskcache_state_t diskcache_freshness(const diskcache_meta_t *meta, time_t now){
+    int64_t maxAge = meta->maxAge > 0 ? meta->maxAge : 0;
+    int64_t staleWindow = meta->staleWindow >= 0 ? meta->staleWindow : defaultStaleWindow;
+
+    if (now < meta->storedAt + maxAge)
+        return DISKCACHE_FRESH;
+    if (now < meta->storedAt + maxAge + staleWindow)
+        return DISKCACHE_STALE;
+    return DISKCACHE_EXPIRED;
+}
+
+off_t diskcache_body_offset(void){
+    return sizeof(diskcache_meta_t);
+}
+
+int diskcache_lookup(const char *path, diskcache_meta_t *meta){
+    char name[PATH_MAX + 32];
+    struct stat statbuf;
+    ssize_t nread;
+    int fd;
+
+    _entry_name(name, sizeof(name), path);
+    if ((fd = open(name, O_RDONLY)) < 0)
+        return -1;
+
+    pthread_mutex_lock(&headerLock);
+    nread = pread(fd, meta, sizeof(*meta), 0);
+    pthread_mutex_unlock(&headerLock);
+
+    if (nread != sizeof(*meta) || memcmp(meta->magic, DISKCACHE_MAGIC, sizeof(meta->magic)) != 0 ||
+        strncmp(meta->path, path, sizeof(meta->path)) != 0 || fstat(fd, &statbuf) != 0 ||
+        (uint64_t) statbuf.st_size != sizeof(*meta) + meta->bodyLen){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int diskcache_store(const char *path, diskcache_meta_t *meta, const char *body, size_t bodyLen){
+    char name[PATH_MAX + 32], temp[PATH_MAX + 64];
+    size_t written = 0;
+    ssize_t n;
+    int fd;
+
+    if (strlen(path) >= sizeof(meta->path))
+        return -1;
+
+    memcpy(meta->magic, DISKCACHE_MAGIC, sizeof(meta->magic));
+    snprintf(meta->path, sizeof(meta->path), "%s", path);
+    meta->storedAt = time(NULL);
+    meta->bodyLen = bodyLen;
+
+    _entry_name(name, sizeof(name), path);
+    snprintf(temp, sizeof(temp), "%s.%d.%lx", name, getpid(), (unsigned long) pthread_self());
+    if ((fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return -1;
+
+    if (write(fd, meta, sizeof(*meta)) != sizeof(*meta))
+        written = bodyLen + 1;
+    while (written < bodyLen && (n = write(fd, body + written, bodyLen - written)) > 0)
+        written += n;
+    close(fd);
+
+    if (written != bodyLen || rename(temp, name) != 0){
+        fprintf(stderr, "Unable to cache %s: %s\n", path, strerror(errno));
+        unlink(temp);
+        return -1;
+    }
+    return 0;
+}
+
+int diskcache_refresh(const char *path, const diskcache_meta_t *response){
+    char name[PATH_MAX + 32];
+    diskcache_meta_t meta;
+    int fd, ret = -1;
+
+    _entry_name(name, sizeof(name), path);
+    if ((fd = open(name, O_RDWR)) < 0)
+        return -1;
+
+    pthread_mutex_lock(&headerLock);
+    if (pread(fd, &meta, sizeof(meta), 0) == sizeof(meta) && strncmp(meta.path, path, sizeof(meta.path)) == 0){
+        // A 304 may update the freshness and validators, what it leaves out stays as it was
+        meta.storedAt = time(NULL);
+        if (response->maxAge >= 0)
+            meta.maxAge = response->maxAge;
+        if (response->staleWindow >= 0)
+            meta.staleWindow = response->staleWindow;
+        if (response->etag[0])
+            memcpy(meta.etag, response->etag, sizeof(meta.etag));
+        if (response->lastModified[0])
+            memcpy(meta.lastModified, response->lastModified, sizeof(meta.lastModified));
+        ret = (pwrite(fd, &meta, sizeof(meta), 0) == sizeof(meta)) ? 0 : -1;
+    }
+    pthread_mutex_unlock(&headerLock);
+
+    close(fd);
+    return ret;
+}
+
+void diskcache_remove(const char *path){
+    char name[PATH_MAX + 32];
+
+    _entry_name(name, sizeof(name), path);
+    unlink(name);
+}
+
+bool diskcache_begin_refresh(const char *path){
+    int freeSlot = -1;
+
+    pthread_mutex_lock(&refreshLock);
+    for (int i = 0; i < MAX_REFRESHING; i++){
+        if (refreshing[i][0] == '\0'){
+            if (freeSlot < 0)
+                freeSlot = i;
+        }
+        else if (strcmp(refreshing[i], path) == 0){
+            freeSlot = -1;
+            break;
+        }
+    }
+    if (freeSlot >= 0)
+        snprintf(refreshing[freeSlot], DISKCACHE_MAX_PATH, "%s", path);
+    pthread_mutex_unlock(&refreshLock);
+
+    return freeSlot >= 0;
+}
+
+void diskcache_end_refresh(const char *path){
+    pthread_mutex_lock(&refreshLock);
+    for (int i = 0; i < MAX_REFRESHING; i++){
+        if (strcmp(refreshing[i], path) == 0){
+            refreshing[i][0] = '\0';
+            break;
+        }
+    }
+    pthread_mutex_unlock(&refreshLock);
+}
@@ -0,0 +1,92 @@
+#ifndef __DISK_CACHE_H__
+#define __DISK_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DISKCACHE_MAX_PATH 128
+#define DISKCACHE_MAX_VALIDATOR 128
+
+/*
+ * Origin responses kept on disk, one file per path: this header, then the
+ * body. Files are written under a temporary name and renamed into place,
+ * so a reader always opens a complete entry; a revalidation only rewrites
+ * the header.
+ */
+typedef struct {
+    char magic[8];
+    char path[DISKCACHE_MAX_PATH]; // Tells entries whose names collide apart
+    int64_t storedAt; // time() of the fetch or of the last revalidation
+    int64_t maxAge; // Seconds fresh after storedAt, -1 if the origin gave none
+    int64_t staleWindow; // Seconds after that it may be served while revalidating, -1 if not given
+    bool noStore; // Cache-Control forbids a shared cache from keeping it
+    char etag[DISKCACHE_MAX_VALIDATOR];
+    char lastModified[DISKCACHE_MAX_VALIDATOR];
+    uint64_t bodyLen;
+} diskcache_meta_t;
+
+typedef enum {
+    DISKCACHE_FRESH,
+    DISKCACHE_STALE, // Past max-age, still within the stale-while-revalidate window
+    DISKCACHE_EXPIRED
+} diskcache_state_t;
+
+/*
+ * Keeps the cache in dir, creating it if needed. staleWindow applies to
+ * responses that don't set stale-while-revalidate. Returns 0 or -1.
+ */
+int diskcache_init(const char *dir, int64_t staleWindow);
+
+bool diskcache_enabled(void);
+
+/*
+ * Clears meta for the headers of a new response.
+ */
+void diskcache_meta_init(diskcache_meta_t *meta);
+
+/*
+ * Picks Cache-Control, ETag and Last-Modified out of one response header line.
+ */
+void diskcache_parse_header(diskcache_meta_t *meta, const char *line, size_t len);
+
+/*
+ * Whether a 200 response with these headers may be kept. Responses that
+ * are never fresh and can't be revalidated are not worth a disk write.
+ */
+bool diskcache_storable(const diskcache_meta_t *meta);
+
+diskcache_state_t diskcache_freshness(const diskcache_meta_t *meta, time_t now);
+
+/*
+ * Opens the entry for path and reads its header into meta. Returns the
+ * descriptor, positioned nowhere in particular (read the body from
+ * diskcache_body_offset() with pread), or -1 if there is no entry.
+ */
+int diskcache_lookup(const char *path, diskcache_meta_t *meta);
+
+off_t diskcache_body_offset(void);
+
+/*
+ * Stores body as the entry for path. Returns 0 or -1.
+ */
+int diskcache_store(const char *path, diskcache_meta_t *meta, const char *body, size_t bodyLen);
+
+/*
+ * Marks the entry for path fresh again after a 304, taking the freshness
+ * and validators the origin sent with it. Returns 0 or -1.
+ */
+int diskcache_refresh(const char *path, const diskcache_meta_t *response);
+
+void diskcache_remove(const char *path);
+
+/*
+ * Claims the background revalidation of path. Returns false if one is
+ * already running; the claimer calls diskcache_end_refresh when done.
+ */
+bool diskcache_begin_refresh(const char *path);
+
+void diskcache_end_refresh(const char *path);
+
+#endif // __DISK_CACHE_H__
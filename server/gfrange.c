@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gfrange.h"
+
+int gfrange_parse(const char *request, char *path, size_t pathLen, gfrange_t *range){
+    const char *tag = strstr(request, GF_RANGE_TAG);
+    size_t len = tag ? (size_t) (tag - request) : strlen(request);
+    char *end;
+
+    range->isRange = false;
+    range->offset = 0;
+    range->length = 0;
+
+    if (len + 1 > pathLen)
+        return -1;
+    memcpy(path, request, len);
+    path[len] = '\0';
+
+    if (tag == NULL)
+        return 0;
+
+    tag += strlen(GF_RANGE_TAG);
+    if (*tag < '0' || *tag > '9')
+        return -1;
+    range->offset = strtoul(tag, &end, 10);
+    if (*end++ != '-')
+        return -1;
+
+    if (*end != '\0'){
+        const char *last = end;
+        size_t lastByte = strtoul(last, &end, 10);
+        if (end == last || *end != '\0' || lastByte < range->offset)
+            return -1;
+        range->length = lastByte - range->offset + 1;
+    }
+
+    range->isRange = true;
+    return 0;
+}
+
+size_t gfrange_span(const gfrange_t *range, size_t fileLen){
+    if (range->offset >= fileLen)
+        return 0;
+    if (range->length == 0 || range->length > fileLen - range->offset)
+        return fileLen - range->offset;
+    return range->length;
+}
@@ -1,10 +1,376 @@
-
-
 #include "gfserver.h"
 #include "proxy-student.h"
+#include "gfrange.h"
 
 #define BUFSIZE (128)
+#define SENDSIZE (16384)
+#define POLL_MS (100)
+
+typedef struct {
+    char url[BUFSIZE];
+    char filePath[BUFSIZE];
+} refreshjob_t;
+
+// Ranged download: connections one object may use, spare connections left over every request
+static int partsPerObject = 1;
+static int spareConnections = 0;
+static size_t partSize = 1 << 20;
+
+void curl_set_ranged_download(int perObject, int total, size_t size){
+    partsPerObject = perObject;
+    spareConnections = total;
+    partSize = size;
+}
+
+// Every request may use one connection, more come out of the shared spares
+static bool _take_spare(void){
+    int spare = __atomic_load_n(&spareConnections, __ATOMIC_RELAXED);
+
+    while (spare > 0)
+        if (__atomic_compare_exchange_n(&spareConnections, &spare, spare - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return true;
+    return false;
+}
+
+static void _return_spare(void){
+    __atomic_fetch_add(&spareConnections, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Gets url into curl_ctx. Asks for the byte range if there is one, and only
+ * for a newer copy than cached if given. Returns the response code, or -1
+ * if the origin could not be reached.
+ */
+static long _fetch(const char *url, const gfrange_t *range, const diskcache_meta_t *cached, curlcontext_t *curl_ctx){
+    char byteRange[BUFSIZE];
+    char validator[BUFSIZE + DISKCACHE_MAX_VALIDATOR];
+    struct curl_slist *headers = NULL;
+    long response_code = -1;
+    CURL * curl_client;
+    CURLcode get_result;
+
+    curl_ctx->buffer = NULL;
+    curl_ctx->bytes_received = 0;
+    diskcache_meta_init(&curl_ctx->meta);
+
+    curl_client = curl_easy_init();
+    if (curl_client == NULL)
+        return -1;
+
+    curl_easy_setopt(curl_client, CURLOPT_WRITEFUNCTION, WriteMemoryCallback); // Passing the function pointer to LC
+    curl_easy_setopt(curl_client, CURLOPT_WRITEDATA, (void *)curl_ctx); // Passing our BufferStruct to LC
+    curl_easy_setopt(curl_client, CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(curl_client, CURLOPT_HEADERDATA, (void *)&curl_ctx->meta);
+    curl_easy_setopt(curl_client, CURLOPT_URL, url);
+    if (range && range->isRange){
+        if (range->length)
+            snprintf(byteRange, sizeof(byteRange), "%zu-%zu", range->offset, range->offset + range->length - 1);
+        else
+            snprintf(byteRange, sizeof(byteRange), "%zu-", range->offset);
+        curl_easy_setopt(curl_client, CURLOPT_RANGE, byteRange);
+    }
+    if (cached){
+        if (cached->etag[0]){
+            snprintf(validator, sizeof(validator), "If-None-Match: %s", cached->etag);
+            headers = curl_slist_append(headers, validator);
+        }
+        if (cached->lastModified[0]){
+            snprintf(validator, sizeof(validator), "If-Modified-Since: %s", cached->lastModified);
+            headers = curl_slist_append(headers, validator);
+        }
+        curl_easy_setopt(curl_client, CURLOPT_HTTPHEADER, headers);
+    }
+
+    get_result = curl_easy_perform(curl_client);
+    if (get_result != CURLE_OK)
+        printf("Curl Error Code %d from %s\n", (int)get_result, curl_easy_strerror(get_result));
+    else
+        curl_easy_getinfo(curl_client, CURLINFO_RESPONSE_CODE, &response_code);
+
+    curl_easy_cleanup(curl_client);
+    curl_slist_free_all(headers);
+    return response_code;
+}
 
+// Brings the disk cache in line with the origin's answer for the whole of filePath
+static void _update_cache(const char *filePath, long response_code, curlcontext_t *curl_ctx){
+    if (response_code == 304)
+        diskcache_refresh(filePath, &curl_ctx->meta);
+    else if (response_code == 200 && diskcache_storable(&curl_ctx->meta))
+        diskcache_store(filePath, &curl_ctx->meta, curl_ctx->buffer, curl_ctx->bytes_received);
+    else if (response_code >= 200 && response_code < 500)
+        diskcache_remove(filePath);
+}
+
+/*
+ * Gets the whole of filePath, conditionally if we hold a copy, and updates
+ * the disk cache with the answer. A 200 body stays in curl_ctx for the
+ * caller. Returns the response code, or -1 if the origin could not be reached.
+ */
+static long _revalidate(const char *url, const char *filePath, const diskcache_meta_t *cached, curlcontext_t *curl_ctx){
+    long response_code = _fetch(url, NULL, cached, curl_ctx);
+
+    _update_cache(filePath, response_code, curl_ctx);
+    return response_code;
+}
+
+// Revalidates a stale entry after it was served
+static void *_refresh(void *arg){
+    refreshjob_t *job = (refreshjob_t*) arg;
+    diskcache_meta_t cached;
+    curlcontext_t curl_ctx;
+    int fd;
+
+    if ((fd = diskcache_lookup(job->filePath, &cached)) >= 0){
+        close(fd);
+        printf("Revalidating %s in the background\n", job->url);
+        _revalidate(job->url, job->filePath, &cached, &curl_ctx);
+        free(curl_ctx.buffer);
+    }
+
+    diskcache_end_refresh(job->filePath);
+    free(job);
+    return NULL;
+}
+
+static void _refresh_in_background(const char *url, const char *filePath){
+    refreshjob_t *job;
+    pthread_t thread;
+
+    // One revalidation per path at a time, the others keep serving the stale copy
+    if (!diskcache_begin_refresh(filePath))
+        return;
+
+    job = (refreshjob_t*) malloc(sizeof(refreshjob_t));
+    snprintf(job->url, sizeof(job->url), "%s", url);
+    snprintf(job->filePath, sizeof(job->filePath), "%s", filePath);
+    if (pthread_create(&thread, NULL, _refresh, job) != 0){
+        diskcache_end_refresh(filePath);
+        free(job);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Sends the requested part of a cached entry, handle_with_file style. Closes fd
+static ssize_t _send_cached(gfcontext_t *ctx, int fd, const diskcache_meta_t *cached, const gfrange_t *range){
+    char buffer[SENDSIZE];
+    size_t body_length = gfrange_span(range, cached->bodyLen);
+    off_t offset = diskcache_body_offset() + (body_length ? range->offset : 0);
+    size_t bytes_sent = 0;
+    ssize_t read_len, write_len;
+
+    gfs_sendheader(ctx, GF_OK, body_length);
+    while(bytes_sent < body_length){
+        size_t want = body_length - bytes_sent < SENDSIZE ? body_length - bytes_sent : SENDSIZE;
+        read_len = pread(fd, buffer, want, offset + bytes_sent);
+        if (read_len <= 0){
+            fprintf(stderr, "cached read error, %zd, %zu, %zu\n", read_len, bytes_sent, body_length);
+            close(fd);
+            return SERVER_FAILURE;
+        }
+        write_len = gfs_send(ctx, buffer, read_len);
+        if (write_len != read_len){
+            fprintf(stderr, "cached write error\n");
+            close(fd);
+            return SERVER_FAILURE;
+        }
+        bytes_sent += write_len;
+    }
+
+    close(fd);
+    return bytes_sent;
+}
+
+// Adds the request for one range of url to multi. Returns 0 or -1
+static int _start_part(CURLM *multi, rangepart_t *part, const char *url, size_t first){
+    char byteRange[BUFSIZE];
+
+    part->data.buffer = NULL;
+    part->data.bytes_received = 0;
+    diskcache_meta_init(&part->data.meta);
+    part->curl_client = curl_easy_init();
+    if (part->curl_client == NULL)
+        return -1;
+
+    snprintf(byteRange, sizeof(byteRange), "%zu-%zu", first + part->offset, first + part->offset + part->length - 1);
+    curl_easy_setopt(part->curl_client, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
+    curl_easy_setopt(part->curl_client, CURLOPT_WRITEDATA, (void *)&part->data);
+    curl_easy_setopt(part->curl_client, CURLOPT_HEADERFUNCTION, RangeHeaderCallback);
+    curl_easy_setopt(part->curl_client, CURLOPT_HEADERDATA, (void *)part);
+    curl_easy_setopt(part->curl_client, CURLOPT_PRIVATE, (void *)part);
+    curl_easy_setopt(part->curl_client, CURLOPT_URL, url);
+    curl_easy_setopt(part->curl_client, CURLOPT_RANGE, byteRange);
+    return curl_multi_add_handle(multi, part->curl_client) == CURLM_OK ? 0 : -1;
+}
+
+static void _stop_part(CURLM *multi, rangepart_t *part){
+    if (part->curl_client){
+        curl_multi_remove_handle(multi, part->curl_client);
+        curl_easy_cleanup(part->curl_client);
+        part->curl_client = NULL;
+    }
+    if (part->isSpare){
+        _return_spare();
+        part->isSpare = false;
+    }
+}
+
+/*
+ * Streams the requested span of url to the client as ranges of partSize
+ * bytes, fetched over up to partsPerObject connections at once and sent in
+ * order as soon as the front of the span is in. The first range is the
+ * probe: a 206 names the object size in Content-Range and the rest is
+ * planned from it. Any other answer has nothing to split, the probe is
+ * finished as a plain fetch and handed back in curl_ctx, with *isStreamed
+ * false, for the caller to answer. A whole object that may be cached is
+ * stored once it is complete. Returns the bytes sent or SERVER_FAILURE.
+ */
+static ssize_t _stream_ranges(gfcontext_t *ctx, const char *url, const char *filePath, const gfrange_t *range,
+                              curlcontext_t *curl_ctx, long *response_code, bool *isStreamed){
+    rangepart_t probe, *rest = NULL;
+    size_t first = range->isRange ? range->offset : 0;
+    size_t spanEnd = range->length ? first + range->length : SIZE_MAX;
+    size_t nParts = 1, nextStart = 1, nextSend = 0, sentInPart = 0, bytes_sent = 0, body_length = 0;
+    bool isPlanned = false, isBaseBusy = true, isFailed, isCaching = false;
+    int nActive = 1, running, queued;
+    CURLM *multi = curl_multi_init();
+    CURLMsg *msg;
+
+    memset(&probe, 0, sizeof(probe));
+    probe.length = (spanEnd - first < partSize) ? spanEnd - first : partSize;
+    isFailed = _start_part(multi, &probe, url, first) != 0;
+    *isStreamed = false;
+
+    while (!isFailed){
+        curl_multi_perform(multi, &running);
+
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL){
+            rangepart_t *part;
+
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &part);
+            part->isDone = true;
+            if (msg->data.result != CURLE_OK){
+                printf("Curl Error Code %d from %s\n", (int)msg->data.result, curl_easy_strerror(msg->data.result));
+                isFailed = true;
+            }
+            else if (part != &probe && part->status != 206)
+                isFailed = true;
+            if (!part->isSpare)
+                isBaseBusy = false;
+            _stop_part(multi, part);
+            nActive--;
+        }
+        if (isFailed)
+            break;
+
+        if (!isPlanned && (probe.isHeaderDone || probe.isDone)){
+            isPlanned = true;
+            if (probe.status == 206 && probe.total > first){
+                if (spanEnd > probe.total)
+                    spanEnd = probe.total;
+                body_length = spanEnd - first;
+                if (probe.length > body_length)
+                    probe.length = body_length;
+                nParts = 1 + (body_length - probe.length + partSize - 1) / partSize;
+                rest = (rangepart_t*) calloc(nParts, sizeof(rangepart_t));
+                for (size_t i = 1; i < nParts; i++){
+                    rest[i].offset = probe.length + (i - 1) * partSize;
+                    rest[i].length = (body_length - rest[i].offset < partSize) ? body_length - rest[i].offset : partSize;
+                }
+                isCaching = diskcache_enabled() && !range->isRange && diskcache_storable(&probe.data.meta);
+                *isStreamed = true;
+                printf("Fetching %s as %zu ranges of %zu bytes\n", url, nParts, partSize);
+                gfs_sendheader(ctx, GF_OK, body_length);
+            }
+        }
+
+        if (isPlanned && !*isStreamed){
+            if (probe.isDone)
+                break;
+        }
+        else if (isPlanned){
+            // Keep the connections we may use busy, in order of the span
+            while (nextStart < nParts && nActive < partsPerObject){
+                rangepart_t *part = &rest[nextStart];
+                if (isBaseBusy && !_take_spare())
+                    break;
+                part->isSpare = isBaseBusy;
+                isBaseBusy = true;
+                nActive++;
+                nextStart++;
+                if (_start_part(multi, part, url, first) != 0){
+                    isFailed = true;
+                    break;
+                }
+            }
+
+            // Send what the front of the span has so far
+            while (nextSend < nParts){
+                rangepart_t *part = nextSend ? &rest[nextSend] : &probe;
+                size_t have = part->data.bytes_received < part->length ? part->data.bytes_received : part->length;
+
+                while (sentInPart < have){
+                    ssize_t nsend = gfs_send(ctx, part->data.buffer + sentInPart, have - sentInPart);
+                    if (nsend <= 0){
+                        printf("error sending insufficient content\n");
+                        isFailed = true;
+                        break;
+                    }
+                    sentInPart += nsend;
+                    bytes_sent += nsend;
+                }
+                if (isFailed)
+                    break;
+                if (sentInPart < part->length){
+                    // A range that ended short will never complete the span
+                    isFailed = part->isDone;
+                    break;
+                }
+                if (!isCaching && nextSend > 0){
+                    free(part->data.buffer);
+                    part->data.buffer = NULL;
+                }
+                nextSend++;
+                sentInPart = 0;
+            }
+            if (isFailed || nextSend == nParts)
+                break;
+        }
+
+        curl_multi_poll(multi, NULL, 0, POLL_MS, NULL);
+    }
+
+    // Done or failed, either way nothing is in flight any more
+    _stop_part(multi, &probe);
+    for (size_t i = 1; i < nParts && rest; i++)
+        _stop_part(multi, &rest[i]);
+    curl_multi_cleanup(multi);
+
+    if (!isFailed && isCaching){
+        char *body = (char*) malloc(body_length);
+        memcpy(body, probe.data.buffer, probe.length);
+        for (size_t i = 1; i < nParts; i++)
+            memcpy(body + rest[i].offset, rest[i].data.buffer, rest[i].length);
+        diskcache_store(filePath, &probe.data.meta, body, body_length);
+        free(body);
+    }
+    for (size_t i = 1; i < nParts && rest; i++)
+        free(rest[i].data.buffer);
+    free(rest);
+
+    if (*isStreamed || isFailed){
+        free(probe.data.buffer);
+        return isFailed ? SERVER_FAILURE : bytes_sent;
+    }
+
+    // Not split, the caller answers from the probe like from any fetch
+    *curl_ctx = probe.data;
+    *response_code = probe.status;
+    return 0;
+}
 
 /*
  * Replace with an implementation of handle_with_curl and any other
@@ -14,57 +380,121 @@ ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void* arg){
 
 
     char url[BUFSIZE];
-    double file_length;
+    char filePath[BUFSIZE];
+    gfrange_t range;
     long response_code;
+    char *body;
+    size_t body_length;
     ssize_t bytes_sent = 0, nsend = 0;
-    CURL * curl_client;
-    CURLcode get_result;
     curlcontext_t curl_ctx;
+    diskcache_meta_t cached;
+    int fd = -1;
 
     //init
     curl_ctx.buffer = NULL;
     curl_ctx.bytes_received = 0;
     curl_ctx.ctx = ctx;
 
+    // A byte range travels as a suffix of the path, the origin gets it as a Range header
+    if (gfrange_parse(path, filePath, sizeof(filePath), &range) != 0){
+        printf("Malformed request %s\n", path);
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    }
+
     //notice arg is the server path as defined in webproxy.c
-    strcpy(url, arg);
-    strcat(url, path); //here file path already starts with "/"
+    if (snprintf(url, sizeof(url), "%s%s", (const char*) arg, filePath) >= sizeof(url)){
+        printf("Request %s is too long\n", path);
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    }
     printf("The requested url is %s\n", url);
 
+    if (diskcache_enabled())
+        fd = diskcache_lookup(filePath, &cached);
 
-    curl_client = curl_easy_init();
-    if(curl_client) {
-        curl_easy_setopt(curl_client, CURLOPT_WRITEFUNCTION, WriteMemoryCallback); // Passing the function pointer to LC
-        curl_easy_setopt(curl_client, CURLOPT_WRITEDATA, (void *)&curl_ctx); // Passing our BufferStruct to LC
-        curl_easy_setopt(curl_client, CURLOPT_URL, url);
-        get_result = curl_easy_perform(curl_client);
+    if (fd >= 0){
+        diskcache_state_t state = diskcache_freshness(&cached, time(NULL));
+
+        if (state == DISKCACHE_STALE)
+            _refresh_in_background(url, filePath);
+        if (state != DISKCACHE_EXPIRED){
+            printf("Serving %s from the disk cache\n", url);
+            return _send_cached(ctx, fd, &cached, &range);
+        }
 
+        // Unchanged, or the origin is down or failing: what we hold is the best answer
+        response_code = _revalidate(url, filePath, &cached, &curl_ctx);
+        if (response_code == 304 || response_code < 0 || response_code >= 500){
+            printf("Serving %s from the disk cache after revalidation (%ld)\n", url, response_code);
+            free(curl_ctx.buffer);
+            return _send_cached(ctx, fd, &cached, &range);
+        }
+        close(fd);
+    }
+    else if (partsPerObject > 1){
+        bool isStreamed;
+        ssize_t streamed = _stream_ranges(ctx, url, filePath, &range, &curl_ctx, &response_code, &isStreamed);
+        if (isStreamed || streamed < 0){
+            printf("Finished streaming %s, size %zd bytes\n", path, streamed);
+            return streamed;
+        }
+        if (response_code == 206){
+            // Partial, but without a size to plan the rest from: ask again for just what the client wants
+            free(curl_ctx.buffer);
+            if (diskcache_enabled() && !range.isRange)
+                response_code = _revalidate(url, filePath, NULL, &curl_ctx);
+            else
+                response_code = _fetch(url, &range, NULL, &curl_ctx);
+        }
+        else if (diskcache_enabled() && !range.isRange)
+            _update_cache(filePath, response_code, &curl_ctx);
     }
+    else if (diskcache_enabled() && !range.isRange)
+        response_code = _revalidate(url, filePath, NULL, &curl_ctx);
+    else
+        response_code = _fetch(url, &range, NULL, &curl_ctx);
 
-    if (get_result != CURLE_OK) {
-        printf("Curl Error Code %d from %s\n", (int)get_result, curl_easy_strerror(get_result));
-        curl_easy_cleanup(curl_client);
+    if (response_code < 0) {
         free(curl_ctx.buffer);
         return SERVER_FAILURE;
     }
 
-    curl_easy_getinfo(curl_client, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &file_length);
-    curl_easy_getinfo(curl_client, CURLINFO_RESPONSE_CODE, &response_code);
-
-    printf("Processed curl result: file content len %f, response code %ld\n", file_length, response_code);
+    printf("Processed curl result: content len %zu, response code %ld\n", curl_ctx.bytes_received, response_code);
 
     /* Error Handling */
-    if(response_code == 404) return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
-    else if(response_code >= 500) return gfs_sendheader(ctx, GF_ERROR, 0);
+    if(response_code == 404){
+        free(curl_ctx.buffer);
+        return gfs_sendheader(ctx, GF_FILE_NOT_FOUND, 0);
+    }
+    else if(response_code >= 500){
+        free(curl_ctx.buffer);
+        return gfs_sendheader(ctx, GF_ERROR, 0);
+    }
+    else if(response_code == 206 && !range.isRange){
+        // Part of an object we asked for whole, sending it as GF_OK would pass it off as all of it
+        printf("Partial content for unranged request %s\n", url);
+        free(curl_ctx.buffer);
+        return SERVER_FAILURE;
+    }
+
+    body = curl_ctx.buffer;
+    body_length = curl_ctx.bytes_received;
+    if (response_code == 416){
+        // Range starts past the end of the file (or a probe met an empty one), same as the cache: nothing to send
+        body_length = 0;
+    }
+    else if (range.isRange && response_code != 206){
+        // The origin ignored the Range header (or we asked for the whole file), slice it here
+        body_length = gfrange_span(&range, curl_ctx.bytes_received);
+        body = curl_ctx.buffer + (body_length ? range.offset : 0);
+    }
 
     /* Normal Send */
-    gfs_sendheader(ctx, GF_OK, file_length);
+    gfs_sendheader(ctx, GF_OK, body_length);
     //send body
-    while(bytes_sent < curl_ctx.bytes_received){
-        nsend = gfs_send(ctx, curl_ctx.buffer, curl_ctx.bytes_received);
-        if(nsend != curl_ctx.bytes_received){
+    while(bytes_sent < body_length){
+        nsend = gfs_send(ctx, body + bytes_sent, body_length - bytes_sent);
+        if(nsend <= 0){
             printf("error sending insufficient content\n");
-            curl_easy_cleanup(curl_client);
             free(curl_ctx.buffer);
             return SERVER_FAILURE;
         }
@@ -74,7 +504,6 @@ ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void* arg){
     printf("Finished sending %s, size %d bytes\n", path, (int)bytes_sent);
 
 	//final clean up
-    curl_easy_cleanup(curl_client);
     free(curl_ctx.buffer);
 
     return bytes_sent;
@@ -101,4 +530,32 @@ static  size_t WriteMemoryCallback(void *buffer, size_t size, size_t nmemb, void
         curl_ctx->buffer[curl_ctx->bytes_received] = 0;
     }
     return nbytes;
-}
\ No newline at end of file
+}
+
+static  size_t HeaderCallback(char *buffer, size_t size, size_t nitems, void *meta){
+    diskcache_parse_header((diskcache_meta_t*) meta, buffer, size * nitems);
+    return size * nitems;
+}
+
+static  size_t RangeHeaderCallback(char *buffer, size_t size, size_t nitems, void *arg){
+    rangepart_t *part = (rangepart_t*) arg;
+    size_t len = size * nitems;
+    unsigned long long total;
+
+    // Each status line starts a new header block, after a 100 Continue or a redirect
+    if (len > 5 && strncmp(buffer, "HTTP/", 5) == 0){
+        const char *space = memchr(buffer, ' ', len);
+        part->status = space ? strtol(space, NULL, 10) : 0;
+        part->isHeaderDone = false;
+        diskcache_meta_init(&part->data.meta);
+    }
+    else if (len <= 2 && (buffer[0] == '\r' || buffer[0] == '\n'))
+        part->isHeaderDone = part->status >= 200;
+    else if (len > 14 && strncasecmp(buffer, "Content-Range:", 14) == 0){
+        const char *slash = memchr(buffer, '/', len);
+        if (slash && sscanf(slash + 1, "%llu", &total) == 1)
+            part->total = total;
+    }
+    diskcache_parse_header(&part->data.meta, buffer, len);
+    return len;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+r"""Stand-in origin for trying webproxy's disk cache (-d) and ranged downloads (-P) offline.
+
+Serves the files under a directory. Every response carries an ETag and a
+Last-Modified, If-None-Match / If-Modified-Since are answered with a 304
+while the file is unchanged, a single byte range gets a 206 (416 past the
+end), and each path gets the Cache-Control given for it with -c ('*' sets
+the default). Edit a file while the proxy runs to see revalidation fetch
+the new body. Every request is logged on one line with the validators and
+range it carried and the status it got.
+
+    python3 origin.py -r ../cache/cached_files -p 8080 \
+        -c '/road.jpg=max-age=5' \
+        -c '/paraglider.jpg=max-age=1, stale-while-revalidate=30' \
+        -c '/yellowstone.jpg=no-store'
+"""
+
+import argparse
+import email.utils
+import hashlib
+import http.server
+import os
+import sys
+
+
+class OriginHandler(http.server.BaseHTTPRequestHandler):
+    root = '.'
+    policies = {}
+
+    def log_message(self, format, *args):
+        pass
+
+    def _log(self, status):
+        print('%s %s inm=%s ims=%s range=%s -> %d' % (
+            self.command, self.path, self.headers.get('If-None-Match'), self.headers.get('If-Modified-Since'),
+            self.headers.get('Range'), status), flush=True)
+
+    def _validators(self, path, content):
+        self.send_header('ETag', '"%s"' % hashlib.md5(content).hexdigest())
+        self.send_header('Last-Modified', email.utils.formatdate(os.path.getmtime(path), usegmt=True))
+        policy = self.policies.get(self.path, self.policies.get('*'))
+        if policy:
+            self.send_header('Cache-Control', policy)
+
+    def _is_unchanged(self, path, content):
+        etag = '"%s"' % hashlib.md5(content).hexdigest()
+        if self.headers.get('If-None-Match') is not None:
+            return etag in [tag.strip() for tag in self.headers['If-None-Match'].split(',')]
+        since = self.headers.get('If-Modified-Since')
+        if since is None:
+            return False
+        try:
+            return int(os.path.getmtime(path)) <= email.utils.parsedate_to_datetime(since).timestamp()
+        except (TypeError, ValueError):
+            return False
+
+    def _range(self, size):
+        """Returns (first, last) of a single 'bytes=a-b' range, None without one, or () past the end"""
+        spec = self.headers.get('Range')
+        if spec is None or not spec.startswith('bytes=') or ',' in spec:
+            return None
+        first, _, last = spec[len('bytes='):].partition('-')
+        if not first:
+            return None
+        first = int(first)
+        last = min(int(last), size - 1) if last else size - 1
+        return (first, last) if first < size and first <= last else ()
+
+    def do_GET(self):
+        path = os.path.join(self.root, self.path.split('?')[0].lstrip('/'))
+        if not os.path.isfile(path):
+            self.send_response(404)
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return self._log(404)
+
+        with open(path, 'rb') as f:
+            content = f.read()
+        body = content
+
+        if self._is_unchanged(path, content):
+            self.send_response(304)
+            self._validators(path, content)
+            self.end_headers()
+            return self._log(304)
+
+        span = self._range(len(body))
+        if span == ():
+            self.send_response(416)
+            self.send_header('Content-Range', 'bytes */%d' % len(body))
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return self._log(416)
+        if span:
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (span[0], span[1], len(body)))
+            body = body[span[0]:span[1] + 1]
+        else:
+            self.send_response(200)
+        self.send_header('Content-Length', str(len(body)))
+        self._validators(path, content)
+        self.end_headers()
+        self.wfile.write(body)
+        self._log(206 if span else 200)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Stand-in HTTP origin for webproxy')
+    parser.add_argument('-p', '--port', type=int, default=8080, help='Listen port (Default: 8080)')
+    parser.add_argument('-r', '--root', default='.', help='Directory to serve (Default: ./)')
+    parser.add_argument('-c', '--cache-control', action='append', default=[], metavar='PATH=VALUE',
+                        help="Cache-Control sent for PATH, '*' for every other path (repeatable)")
+    args = parser.parse_args()
+
+    OriginHandler.root = args.root
+    for policy in args.cache_control:
+        path, sep, value = policy.partition('=')
+        if not sep:
+            sys.exit('origin.py: -c takes PATH=VALUE, got %s' % policy)
+        OriginHandler.policies[path] = value
+
+    print('Serving %s on 127.0.0.1:%d' % (args.root, args.port), flush=True)
+    http.server.ThreadingHTTPServer(('127.0.0.1', args.port), OriginHandler).serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -5,15 +5,39 @@
 #define __SERVER_STUDENT_H__
 
 #include "steque.h"
+#include "diskcache.h"
 
 // Define a struct for accepting LibCurl's output
 typedef struct curlcontext_t{
     gfcontext_t * ctx;
     char * buffer;
     size_t bytes_received;
+    diskcache_meta_t meta; // What the response headers say about caching it
 }curlcontext_t;
 
+// One byte range of an object fetched over several connections
+typedef struct rangepart_t{
+    curlcontext_t data;
+    CURL * curl_client;
+    size_t offset; // Of its first byte within the requested span
+    size_t length;
+    long status;
+    size_t total; // Object size from Content-Range, 0 if the origin sent none
+    bool isHeaderDone;
+    bool isDone;
+    bool isSpare; // Runs on one of the shared spare connections
+}rangepart_t;
+
+// Connections one object may be fetched over (1 turns ranged download off), spares for all, bytes per range
+void curl_set_ranged_download(int perObject, int total, size_t size);
+
 // This is the function we pass to LibCurl: writes the output to a FileStruct
 static  size_t WriteMemoryCallback(void *, size_t, size_t, void *);
 
+// Passed to LibCurl for each response header line, picks out the caching headers
+static  size_t HeaderCallback(char *, size_t, size_t, void *);
+
+// Like HeaderCallback, also keeping the status and Content-Range of a rangepart_t
+static  size_t RangeHeaderCallback(char *, size_t, size_t, void *);
+
 #endif // __SERVER_STUDENT_H__
\ No newline at end of file
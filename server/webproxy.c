@@ -1,13 +1,19 @@
 #include "gfserver.h"
+#include "diskcache.h"
 
 #define USAGE                                                                         \
 "usage:\n"                                                                            \
 "  webproxy [options]\n"                                                              \
 "options:\n"                                                                          \
+"  -d [cache_dir]      Keep origin responses in this directory, revalidating them when they expire\n" \
 "  -h                  Show this help message\n"                                      \
+"  -C [connections]    Extra origin connections shared by all ranged downloads (Default: 0)\n" \
+"  -P [parts]          Fetch an object over up to this many connections at once, as byte ranges (Default: 1, off)\n" \
 "  -s [server]         The server to connect to (Default: GitHub test data)\n"        \
 "  -t [thread_count]   Num worker threads (Default is 42, Range is 1-256)\n"          \
-"  -p [listen_port]    Listen port (Default: 10823)\n"                                
+"  -p [listen_port]    Listen port (Default: 10823)\n"                                \
+"  -z [part_size]      Bytes in each range of a ranged download (Default: 1048576)\n" \
+"  -w [seconds]        Serve expired responses while revalidating them this long, when the origin doesn't say (Default: 0)\n"
 
 
 /* OPTIONS DESCRIPTOR ====================================================== */
@@ -16,11 +22,17 @@ static struct option gLongOptions[] = {
   {"thread-count",  required_argument,      NULL,           't'},
   {"port",          required_argument,      NULL,           'p'},
   {"server",        required_argument,      NULL,           's'},
+  {"cache-dir",     required_argument,      NULL,           'd'},
+  {"stale-window",  required_argument,      NULL,           'w'},
+  {"parts",         required_argument,      NULL,           'P'},
+  {"connections",   required_argument,      NULL,           'C'},
+  {"part-size",     required_argument,      NULL,           'z'},
   {NULL,            0,                      NULL,            0}
 };
 
 extern ssize_t handle_with_file(gfcontext_t *ctx, const char *path, void* arg);
 extern ssize_t handle_with_curl(gfcontext_t *ctx, const char *path, void* arg);
+extern void curl_set_ranged_download(int perObject, int total, size_t size);
 
 static gfserver_t gfs;
 
@@ -37,6 +49,11 @@ int main(int argc, char **argv) {
   unsigned short port = 10823;
   unsigned short nworkerthreads = 42;
   const char *server = "https://raw.githubusercontent.com/gt-cs6200/image_data";
+  const char *cacheDir = NULL;
+  long staleWindow = 0;
+  int partsPerObject = 1;
+  int spareConnections = 0;
+  long partSize = 1 << 20;
 
   // disable buffering on stdout so it prints immediately 
   setbuf(stdout, NULL);
@@ -52,7 +69,7 @@ int main(int argc, char **argv) {
   }
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "qp:s:t:xh", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "qp:s:t:xhd:w:P:C:z:", gLongOptions, NULL)) != -1) {
     switch (option_char) {
       default:
         fprintf(stderr, "%s", USAGE);
@@ -73,6 +90,21 @@ int main(int argc, char **argv) {
       case 't': // thread-count
         nworkerthreads = atoi(optarg);
         break;
+      case 'd': // cache-dir
+        cacheDir = optarg;
+        break;
+      case 'w': // stale-window
+        staleWindow = atol(optarg);
+        break;
+      case 'P': // parts
+        partsPerObject = atoi(optarg);
+        break;
+      case 'C': // connections
+        spareConnections = atoi(optarg);
+        break;
+      case 'z': // part-size
+        partSize = atol(optarg);
+        break;
    }
   }
 
@@ -92,6 +124,33 @@ int main(int argc, char **argv) {
     exit(__LINE__);
   }
 
+  if (staleWindow < 0) {
+    fprintf(stderr, "Invalid stale window\n");
+    exit(__LINE__);
+  }
+
+  if ((partsPerObject < 1) || (partsPerObject > 64)) {
+    fprintf(stderr, "Invalid number of parts per object\n");
+    exit(__LINE__);
+  }
+
+  if (spareConnections < 0) {
+    fprintf(stderr, "Invalid number of connections\n");
+    exit(__LINE__);
+  }
+
+  if (partSize < 4096) {
+    fprintf(stderr, "Invalid part size\n");
+    exit(__LINE__);
+  }
+
+  curl_set_ranged_download(partsPerObject, spareConnections, partSize);
+
+  if (cacheDir && diskcache_init(cacheDir, staleWindow) != 0) {
+    fprintf(stderr, "Unable to use cache directory %s: %s\n", cacheDir, strerror(errno));
+    exit(__LINE__);
+  }
+
   // Initialize server structure here
   gfserver_init(&gfs, nworkerthreads);
 